@@ -0,0 +1,150 @@
+/*
+ * Helpers shared by xkey-bench and xkey-churn: the
+ * clock, the child processes (Xvfb and xkey) and what
+ * they read of xkey from /proc.
+ */
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <X11/Xlib.h>
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* --------------------------------------------------
+ * Child processes (Xvfb and xkey).
+ * -------------------------------------------------- */
+static inline pid_t spawn(char *const argv[], const char *dir)
+{
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0)
+    {
+        if (dir && chdir(dir) != 0)
+        {
+            perror(dir);
+            _exit(127);
+        }
+        execvp(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    return pid;
+}
+
+static inline void stop(pid_t pid)
+{
+    if (pid <= 0)
+        return;
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+/*
+ * Wait up to `timeout_s' for `path' to be non-empty.
+ * Returns 0 if `pid' exited first (and is reaped) or it
+ * timed out.
+ */
+static inline int wait_file(const char *path, pid_t pid, int timeout_s)
+{
+    uint64_t deadline = now_ns() + (uint64_t)timeout_s * 1000000000ull;
+    struct stat st;
+
+    while (stat(path, &st) != 0 || st.st_size == 0)
+    {
+        if (waitpid(pid, NULL, WNOHANG) == pid || now_ns() > deadline)
+            return 0;
+        usleep(1000);
+    }
+    return 1;
+}
+
+// `prog' prefixes the error if the server never answers
+static inline Display *start_xvfb(const char *prog, const char *display, pid_t *pid)
+{
+    char *argv[] = {"Xvfb", (char *)display, "-screen", "0", "1280x1024x24",
+                    "-nolisten", "tcp", NULL};
+    *pid = spawn(argv, NULL);
+
+    for (int tries = 0; tries < 100; tries++)
+    {
+        Display *d = XOpenDisplay(display);
+        if (d)
+            return d;
+        usleep(50000);
+    }
+    fprintf(stderr, "%s: Xvfb did not come up on %s\n", prog, display);
+    stop(*pid);
+    exit(1);
+}
+
+/* --------------------------------------------------
+ * /proc readers.
+ * -------------------------------------------------- */
+
+/*
+ * Field `key' of /proc/<pid>/status in kB, -1 if the
+ * process is gone.
+ */
+static inline long proc_status_kb(pid_t pid, const char *key)
+{
+    char path[64], line[256];
+    size_t klen = strlen(key);
+    long v = -1;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return -1;
+    while (fgets(line, sizeof(line), f))
+    {
+        if (strncmp(line, key, klen) == 0 && line[klen] == ':')
+        {
+            v = strtol(line + klen + 1, NULL, 10);
+            break;
+        }
+    }
+    fclose(f);
+    return v;
+}
+
+// User + system CPU time of `pid', in ms
+static inline double proc_cpu_ms(pid_t pid)
+{
+    char path[64], buf[1024];
+    unsigned long utime = 0, stime = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return 0.0;
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+
+    // Fields 14 and 15, counted after the ")" that ends comm
+    char *p = strrchr(buf, ')');
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                     &utime, &stime) != 2)
+        return 0.0;
+    return (utime + stime) * 1000.0 / sysconf(_SC_CLK_TCK);
+}
+
+#endif /* BENCH_UTIL_H */
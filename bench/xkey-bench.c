@@ -0,0 +1,430 @@
+/*
+ * Usage Example:
+ *    gcc -O2 -o bench/xkey-bench bench/xkey-bench.c -lX11 -lXtst -pthread
+ *    gcc -o xkey xkey.c -lX11 -lm -pthread
+ *    bench/xkey-bench --xkey=./xkey --windows=200 --depth=3 --rate=2000 --count=20000
+ *    bench/xkey-bench --mode=catchall -- --flush-ms=10
+ *
+ * End-to-end benchmark for xkey. It starts its own Xvfb, creates
+ * `windows' top-level windows with a nested chain of `depth'
+ * children each, then runs xkey in a scratch directory and injects
+ * `count' key presses into one of them with XTestFakeKeyEvent at
+ * `rate' presses per second.
+ *
+ * Capture-to-disk latency is measured by watching keylog.txt with
+ * inotify: the n-th logged key is matched to the n-th injected press.
+ * Keys that never show up are reported as dropped.
+ *
+ * Both paths of snoop_windows() are covered: `designated' writes a
+ * config.txt naming the target window, `catchall' one that matches
+ * nothing. The default runs both. Arguments after `--' go to xkey.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/keysym.h>
+#include <X11/extensions/XTest.h>
+
+#include "bench-util.h"
+
+// Injected key; window names must not contain it.
+#define BENCH_KEYSYM XK_z
+#define BENCH_CHAR 'z'
+
+struct bench_opts
+{
+    const char *xkey;
+    const char *display;
+    int windows;
+    int depth;
+    int rate;
+    int count;
+    int drain_ms;
+    int timeout_s;
+    int run_designated;
+    int run_catchall;
+    char **xkey_args;
+    int xkey_nargs;
+};
+
+static void sleep_until(uint64_t t)
+{
+    struct timespec ts = {.tv_sec = (time_t)(t / 1000000000ull),
+                          .tv_nsec = (long)(t % 1000000000ull)};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+/* --------------------------------------------------
+ * Window tree: `windows' top-levels named
+ * "bench-NNNNN", each with a chain of `depth' children.
+ * Returns the innermost child of the first top-level,
+ * which receives the injected keys.
+ * -------------------------------------------------- */
+static Window create_windows(Display *d, int windows, int depth)
+{
+    Window root = DefaultRootWindow(d);
+    Window target = None;
+
+    for (int i = 0; i < windows; i++)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "bench-%05d", i);
+
+        Window top = XCreateSimpleWindow(d, root, (i % 32) * 20, (i / 32) * 20, 200, 100, 0, 0, 0);
+        XStoreName(d, top, name);
+
+        Window w = top;
+        for (int k = 0; k < depth; k++)
+        {
+            w = XCreateSimpleWindow(d, w, 0, 0, 200, 100, 0, 0, 0);
+            XMapWindow(d, w);
+        }
+        XMapWindow(d, top);
+
+        if (i == 0)
+            target = w;
+    }
+    XSync(d, False);
+    return target;
+}
+
+/* --------------------------------------------------
+ * Log watcher: counts BENCH_CHAR bytes appended to
+ * keylog.txt and stamps each one on arrival.
+ * -------------------------------------------------- */
+struct watcher
+{
+    char path[4096];
+    uint64_t *seen_ns; // arrival time of the n-th key
+    int capacity;
+    atomic_int seen;
+    atomic_int stop;
+};
+
+static void *watch_log(void *arg)
+{
+    struct watcher *w = arg;
+    int ifd = inotify_init1(IN_CLOEXEC);
+    int fd = -1;
+    char buf[65536];
+
+    while (!atomic_load(&w->stop))
+    {
+        if (fd < 0)
+        {
+            fd = open(w->path, O_RDONLY);
+            if (fd < 0)
+            {
+                usleep(1000);
+                continue;
+            }
+            inotify_add_watch(ifd, w->path, IN_MODIFY);
+        }
+
+        ssize_t n;
+        while ((n = read(fd, buf, sizeof(buf))) > 0)
+        {
+            uint64_t t = now_ns();
+            for (ssize_t i = 0; i < n; i++)
+            {
+                int s = atomic_load_explicit(&w->seen, memory_order_relaxed);
+                if (buf[i] == BENCH_CHAR && s < w->capacity)
+                {
+                    w->seen_ns[s] = t;
+                    atomic_store(&w->seen, s + 1);
+                }
+            }
+        }
+
+        struct pollfd pfd = {.fd = ifd, .events = POLLIN};
+        if (poll(&pfd, 1, 10) > 0)
+        {
+            char ev[4096];
+            if (read(ifd, ev, sizeof(ev)) < 0 && errno != EAGAIN)
+                perror("inotify");
+        }
+    }
+
+    if (fd >= 0)
+        close(fd);
+    close(ifd);
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(const uint64_t *sorted, int n, double p)
+{
+    if (n == 0)
+        return 0.0;
+    int i = (int)(p * (n - 1) + 0.5);
+    return sorted[i] / 1e6;
+}
+
+/* --------------------------------------------------
+ * One run: fresh scratch dir and xkey, same Xvfb.
+ * -------------------------------------------------- */
+static void run(Display *d, Window target, const struct bench_opts *o, int designated)
+{
+    char dir[] = "/tmp/xkey-bench.XXXXXX";
+    if (!mkdtemp(dir))
+    {
+        perror("mkdtemp");
+        exit(1);
+    }
+
+    char path[4096], stats_path[4096], stats_arg[4200];
+    snprintf(path, sizeof(path), "%s/config.txt", dir);
+    snprintf(stats_path, sizeof(stats_path), "%s/xkey.stats", dir);
+    snprintf(stats_arg, sizeof(stats_arg), "--stats-file=%s", stats_path);
+    FILE *cfg = fopen(path, "w");
+    if (!cfg)
+    {
+        perror(path);
+        exit(1);
+    }
+    fputs(designated ? "bench-00000" : "no-such-window", cfg);
+    fclose(cfg);
+
+    // xkey runs in `dir', so resolve its path first
+    char xkey[4096];
+    if (!realpath(o->xkey, xkey))
+    {
+        perror(o->xkey);
+        exit(1);
+    }
+
+    char **argv = calloc((size_t)o->xkey_nargs + 4, sizeof(*argv));
+    int argc = 0;
+    argv[argc++] = xkey;
+    argv[argc++] = stats_arg;
+    for (int i = 0; i < o->xkey_nargs; i++)
+        argv[argc++] = o->xkey_args[i];
+    argv[argc++] = (char *)o->display;
+
+    struct watcher w = {.capacity = o->count};
+    snprintf(w.path, sizeof(w.path), "%s/keylog.txt", dir);
+    w.seen_ns = calloc((size_t)o->count, sizeof(*w.seen_ns));
+    uint64_t *sent_ns = calloc((size_t)o->count, sizeof(*sent_ns));
+    atomic_init(&w.seen, 0);
+    atomic_init(&w.stop, 0);
+
+    uint64_t t_start = now_ns();
+    pid_t xkey_pid = spawn(argv, dir);
+
+    // keylog.txt is opened after signals are blocked, and the
+    // SIGUSR1 is only read once input is selected, so the
+    // stats file shows up when xkey is ready.
+    if (!wait_file(w.path, xkey_pid, o->timeout_s))
+    {
+        fprintf(stderr, "xkey-bench: xkey exited or timed out before opening its log\n");
+        goto out;
+    }
+    kill(xkey_pid, SIGUSR1);
+    if (!wait_file(stats_path, xkey_pid, o->timeout_s))
+    {
+        fprintf(stderr, "xkey-bench: xkey exited or timed out during startup\n");
+        goto out;
+    }
+    uint64_t startup_ns = now_ns() - t_start;
+
+    pthread_t watcher;
+    pthread_create(&watcher, NULL, watch_log, &w);
+
+    XSetInputFocus(d, target, RevertToParent, CurrentTime);
+    XSync(d, False);
+
+    KeyCode kc = XKeysymToKeycode(d, BENCH_KEYSYM);
+    uint64_t period = 1000000000ull / (uint64_t)o->rate;
+    uint64_t t0 = now_ns();
+
+    for (int i = 0; i < o->count; i++)
+    {
+        sleep_until(t0 + (uint64_t)i * period);
+        sent_ns[i] = now_ns();
+        XTestFakeKeyEvent(d, kc, True, CurrentTime);
+        XTestFakeKeyEvent(d, kc, False, CurrentTime);
+        XFlush(d);
+    }
+    uint64_t t_sent = now_ns();
+
+    // Wait for stragglers, then stop xkey (which flushes)
+    uint64_t deadline = t_sent + (uint64_t)o->drain_ms * 1000000ull;
+    while (atomic_load(&w.seen) < o->count && now_ns() < deadline)
+        usleep(1000);
+    stop(xkey_pid);
+    usleep(100000);
+    atomic_store(&w.stop, 1);
+    pthread_join(watcher, NULL);
+
+    int seen = atomic_load(&w.seen);
+    uint64_t *lat = calloc((size_t)seen + 1, sizeof(*lat));
+    uint64_t t_last = t0;
+    for (int i = 0; i < seen; i++)
+    {
+        lat[i] = w.seen_ns[i] > sent_ns[i] ? w.seen_ns[i] - sent_ns[i] : 0;
+        if (w.seen_ns[i] > t_last)
+            t_last = w.seen_ns[i];
+    }
+    qsort(lat, (size_t)seen, sizeof(*lat), cmp_u64);
+
+    double secs = (t_last - t0) / 1e9;
+    printf("%-10s windows=%d depth=%d rate=%d/s count=%d\n",
+           designated ? "designated" : "catchall", o->windows, o->depth, o->rate, o->count);
+    printf("  startup     %.1f ms\n", startup_ns / 1e6);
+    printf("  throughput  %.1f events/s (offered %.1f/s)\n",
+           secs > 0 ? seen / secs : 0.0, o->count / ((t_sent - t0) / 1e9));
+    printf("  dropped     %d of %d\n", o->count - seen, o->count);
+    printf("  latency     p50 %.3f ms  p99 %.3f ms  p999 %.3f ms  max %.3f ms\n",
+           percentile_ms(lat, seen, 0.50), percentile_ms(lat, seen, 0.99),
+           percentile_ms(lat, seen, 0.999), seen ? lat[seen - 1] / 1e6 : 0.0);
+    fflush(stdout);
+
+    free(lat);
+    xkey_pid = 0;
+
+out:
+    stop(xkey_pid);
+    free(sent_ns);
+    free(w.seen_ns);
+    free(argv);
+
+    unlink(w.path);
+    unlink(stats_path);
+    unlink(path);
+    rmdir(dir);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [options] [-- xkey options]\n", prog);
+    fprintf(stderr, "  --xkey=PATH      xkey binary (default ./xkey)\n");
+    fprintf(stderr, "  --display=:N     display for the private Xvfb (default :99)\n");
+    fprintf(stderr, "  --windows=N      top-level windows (default 100)\n");
+    fprintf(stderr, "  --depth=D        nested children per window (default 2)\n");
+    fprintf(stderr, "  --rate=R         key presses per second (default 1000)\n");
+    fprintf(stderr, "  --count=N        key presses per run (default 10000)\n");
+    fprintf(stderr, "  --drain-ms=T     wait for late keys after the last press (default 2000)\n");
+    fprintf(stderr, "  --timeout=S      give up on an xkey startup after S s (default 120)\n");
+    fprintf(stderr, "  --mode=M         designated, catchall or both (default both)\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_opts o = {
+        .xkey = "./xkey",
+        .display = ":99",
+        .windows = 100,
+        .depth = 2,
+        .rate = 1000,
+        .count = 10000,
+        .drain_ms = 2000,
+        .timeout_s = 120,
+        .run_designated = 1,
+        .run_catchall = 1,
+    };
+
+    static const struct option long_opts[] = {
+        {"xkey", required_argument, NULL, 'x'},
+        {"display", required_argument, NULL, 'd'},
+        {"windows", required_argument, NULL, 'w'},
+        {"depth", required_argument, NULL, 'D'},
+        {"rate", required_argument, NULL, 'r'},
+        {"count", required_argument, NULL, 'n'},
+        {"drain-ms", required_argument, NULL, 't'},
+        {"timeout", required_argument, NULL, 'T'},
+        {"mode", required_argument, NULL, 'm'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", long_opts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'x':
+            o.xkey = optarg;
+            break;
+        case 'd':
+            o.display = optarg;
+            break;
+        case 'w':
+            o.windows = atoi(optarg);
+            break;
+        case 'D':
+            o.depth = atoi(optarg);
+            break;
+        case 'r':
+            o.rate = atoi(optarg);
+            break;
+        case 'n':
+            o.count = atoi(optarg);
+            break;
+        case 't':
+            o.drain_ms = atoi(optarg);
+            break;
+        case 'T':
+            o.timeout_s = atoi(optarg);
+            break;
+        case 'm':
+            o.run_designated = strcmp(optarg, "catchall") != 0;
+            o.run_catchall = strcmp(optarg, "designated") != 0;
+            break;
+        default:
+            usage(argv[0]);
+            exit(opt == 'h' ? 0 : 1);
+        }
+    }
+    o.xkey_args = argv + optind;
+    o.xkey_nargs = argc - optind;
+
+    if (o.windows < 1 || o.depth < 0 || o.rate < 1 || o.count < 1 || o.timeout_s < 1)
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    pid_t xvfb;
+    Display *d = start_xvfb("xkey-bench", o.display, &xvfb);
+
+    int ev, err, major, minor;
+    if (!XTestQueryExtension(d, &ev, &err, &major, &minor))
+    {
+        fprintf(stderr, "xkey-bench: Xvfb has no XTEST extension\n");
+        stop(xvfb);
+        exit(1);
+    }
+
+    Window target = create_windows(d, o.windows, o.depth);
+
+    if (o.run_designated)
+        run(d, target, &o, 1);
+    if (o.run_catchall)
+        run(d, target, &o, 0);
+
+    XCloseDisplay(d);
+    stop(xvfb);
+    return 0;
+}
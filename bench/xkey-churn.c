@@ -0,0 +1,785 @@
+/*
+ * Usage Example:
+ *    gcc -O2 -o bench/xkey-churn bench/xkey-churn.c -lX11 -lXtst
+ *    gcc -DXKEY_XI2 -o xkey xkey.c -lX11 -lXi -lm -pthread
+ *    bench/xkey-churn --xkey=./xkey --sizes=10,100,1000,10000 --json=churn.json
+ *    bench/xkey-churn --backends=track --baseline=churn.json --max-regress=20
+ *
+ * Window-churn scaling benchmark for xkey. For every tree size it
+ * starts with `sizes' top-level windows in its own Xvfb, each with
+ * a nested chain of 0 to `max-depth' children (window i gets
+ * i % (max-depth + 1)), and runs xkey once per backend on it:
+ *   scan   --full-scan: the recursive walk at startup, nothing after
+ *   track  --track: incremental tracking of new windows
+ *   xi2    --xi2: raw keys from XInput2 (xkey built with -DXKEY_XI2)
+ *
+ * Once xkey is up, `churn' new windows are created and mapped one
+ * after another, each focused and typed into once, and unmapped and
+ * destroyed again once `live' newer ones exist. Reported per run:
+ *   - startup_scan_ms: xkey's own startup_scan_us stat
+ *   - ready_ms: spawn until xkey answers SIGUSR1
+ *   - rss_kb_*: xkey's resident memory after startup and churn
+ *   - rss_bytes_per_window: growth over the smallest size
+ *   - cpu_us_per_window: xkey CPU time during churn per new window
+ *   - captured / missed: new windows whose key made it to the log
+ *
+ * Like a window manager, the bench keeps _NET_CLIENT_LIST and
+ * _NET_ACTIVE_WINDOW on the root (--no-ewmh leaves them unset).
+ * --json writes the results, one run per line; given an earlier
+ * such file, --baseline fails the run (exit 2) if any cost grew, or
+ * the capture count fell, by more than --max-regress percent, or if
+ * a run failed or a run of the baseline was not repeated. A baseline
+ * taken with another --max-depth or --churn is refused.
+ * Arguments after `--' go to xkey.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/Xutil.h>
+#include <X11/keysym.h>
+#include <X11/extensions/XTest.h>
+
+#include "bench-util.h"
+
+// Injected key; window names must not contain it.
+#define BENCH_KEYSYM XK_z
+#define BENCH_CHAR 'z'
+
+#define MAX_SIZES 16
+#define MAX_RUNS (MAX_SIZES * 3)
+#define LIVE_MAX 64
+
+static const struct backend
+{
+    const char *name;
+    const char *arg;
+} backends[] = {
+    {"scan", "--full-scan"},
+    {"track", "--track"},
+    {"xi2", "--xi2"},
+};
+#define NBACKENDS (int)(sizeof(backends) / sizeof(backends[0]))
+
+struct bench_opts
+{
+    const char *xkey;
+    const char *display;
+    int sizes[MAX_SIZES];
+    int nsizes;
+    int max_depth;
+    int churn;
+    int live;
+    int settle_us;
+    int drain_ms;
+    int timeout_s;
+    int ewmh;
+    int run_backend[NBACKENDS];
+    const char *json;
+    const char *baseline;
+    double max_regress;
+    char **xkey_args;
+    int xkey_nargs;
+};
+
+struct result
+{
+    const char *backend;
+    int windows;      // top-levels at startup
+    int tree_windows; // ... and their children
+    const char *error;
+    double startup_scan_ms;
+    double ready_ms;
+    long rss_kb_start, rss_kb_end, rss_hwm_kb;
+    double rss_bytes_per_window; // < 0: not known (smallest size)
+    double cpu_ms_churn;
+    double cpu_us_per_window;
+    int churn, captured;
+};
+
+static struct result results[MAX_RUNS];
+static int nresults = 0;
+
+static Atom atom_client_list, atom_active_window;
+
+/* --------------------------------------------------
+ * Window tree: `windows' top-levels named
+ * "bench-NNNNN" with 0 to `max_depth' nested children.
+ * -------------------------------------------------- */
+static Window create_window(Display *d, const char *name, int x, int y, int depth)
+{
+    Window top = XCreateSimpleWindow(d, DefaultRootWindow(d), x, y, 200, 100, 0, 0, 0);
+    XStoreName(d, top, name);
+
+    Window w = top;
+    for (int k = 0; k < depth; k++)
+    {
+        w = XCreateSimpleWindow(d, w, 0, 0, 200, 100, 0, 0, 0);
+        XMapWindow(d, w);
+    }
+    XMapWindow(d, top);
+    return top;
+}
+
+static Window *create_tree(Display *d, int windows, int max_depth, int ewmh, int *total)
+{
+    Window *tops = calloc((size_t)windows, sizeof(*tops));
+    if (!tops)
+    {
+        perror("calloc");
+        exit(1);
+    }
+
+    *total = 0;
+    for (int i = 0; i < windows; i++)
+    {
+        char name[32];
+        int depth = i % (max_depth + 1);
+        snprintf(name, sizeof(name), "bench-%05d", i);
+        tops[i] = create_window(d, name, (i % 32) * 20, (i / 32) * 20, depth);
+        *total += 1 + depth;
+    }
+    if (ewmh)
+        XChangeProperty(d, DefaultRootWindow(d), atom_client_list, XA_WINDOW, 32,
+                        PropModeReplace, (unsigned char *)tops, windows);
+    XSync(d, False);
+    return tops;
+}
+
+static void destroy_tree(Display *d, Window *tops, int windows)
+{
+    for (int i = 0; i < windows; i++)
+        XDestroyWindow(d, tops[i]);
+    XDeleteProperty(d, DefaultRootWindow(d), atom_client_list);
+    XSync(d, False);
+    free(tops);
+}
+
+/* --------------------------------------------------
+ * Results from xkey's files.
+ * -------------------------------------------------- */
+
+// First "  startup_scan_us   N" line of the stats file, -1 if none
+static double stats_scan_ms(const char *path)
+{
+    char line[256];
+    double ms = -1.0;
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return ms;
+    while (fgets(line, sizeof(line), f))
+    {
+        unsigned long long us;
+        if (sscanf(line, " startup_scan_us %llu", &us) == 1)
+        {
+            ms = us / 1e3;
+            break;
+        }
+    }
+    fclose(f);
+    return ms;
+}
+
+/*
+ * Churn windows whose key shows up in keylog.txt, after
+ * a FocusIn naming them.
+ */
+static int count_captured(const char *path, int churn)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return 0;
+
+    char *seen = calloc((size_t)churn, 1);
+    char line[4096];
+    int cur = -1, captured = 0;
+    while (fgets(line, sizeof(line), f))
+    {
+        const char *p = strstr(line, "] FocusIn: ");
+        if (p)
+        {
+            int i;
+            cur = sscanf(p, "] FocusIn: churn-%d", &i) == 1 && i >= 0 && i < churn ? i : -1;
+            continue;
+        }
+        if (cur >= 0 && !seen[cur] && strchr(line, BENCH_CHAR))
+        {
+            seen[cur] = 1;
+            captured++;
+        }
+    }
+    free(seen);
+    fclose(f);
+    return captured;
+}
+
+/* --------------------------------------------------
+ * One run: fresh scratch dir and xkey, same Xvfb and
+ * starting tree.
+ * -------------------------------------------------- */
+static void run(Display *d, const struct bench_opts *o, const struct backend *b,
+                int windows, int tree_windows)
+{
+    if (nresults == MAX_RUNS)
+    {
+        fprintf(stderr, "xkey-churn: more than %d runs\n", MAX_RUNS);
+        exit(1);
+    }
+    struct result *r = &results[nresults++];
+    memset(r, 0, sizeof(*r));
+    r->backend = b->name;
+    r->windows = windows;
+    r->tree_windows = tree_windows;
+    r->rss_bytes_per_window = -1.0;
+    r->churn = o->churn;
+
+    char dir[] = "/tmp/xkey-churn.XXXXXX";
+    if (!mkdtemp(dir))
+    {
+        perror("mkdtemp");
+        exit(1);
+    }
+
+    // Catch-all: every window is captured
+    char cfg_path[4096], log_path[4096], stats_path[4096], stats_arg[4200];
+    snprintf(cfg_path, sizeof(cfg_path), "%s/config.txt", dir);
+    snprintf(log_path, sizeof(log_path), "%s/keylog.txt", dir);
+    snprintf(stats_path, sizeof(stats_path), "%s/xkey.stats", dir);
+    snprintf(stats_arg, sizeof(stats_arg), "--stats-file=%s", stats_path);
+    FILE *cfg = fopen(cfg_path, "w");
+    if (!cfg)
+    {
+        perror(cfg_path);
+        exit(1);
+    }
+    fputs("no-such-window", cfg);
+    fclose(cfg);
+
+    // xkey runs in `dir', so resolve its path first
+    char xkey[4096];
+    if (!realpath(o->xkey, xkey))
+    {
+        perror(o->xkey);
+        exit(1);
+    }
+
+    char **argv = calloc((size_t)o->xkey_nargs + 5, sizeof(*argv));
+    int argc = 0;
+    argv[argc++] = xkey;
+    argv[argc++] = (char *)b->arg;
+    argv[argc++] = stats_arg;
+    for (int i = 0; i < o->xkey_nargs; i++)
+        argv[argc++] = o->xkey_args[i];
+    argv[argc++] = (char *)o->display;
+
+    uint64_t t_start = now_ns();
+    pid_t xkey_pid = spawn(argv, dir);
+
+    // keylog.txt is opened after signals are blocked, and the
+    // signal is only read once startup is done, so the stats
+    // file shows up when xkey is ready.
+    if (!wait_file(log_path, xkey_pid, o->timeout_s))
+    {
+        r->error = "xkey exited or timed out before opening its log";
+        goto out;
+    }
+    kill(xkey_pid, SIGUSR1);
+    if (!wait_file(stats_path, xkey_pid, o->timeout_s))
+    {
+        r->error = "xkey exited or timed out during startup";
+        goto out;
+    }
+    r->ready_ms = (now_ns() - t_start) / 1e6;
+    r->rss_kb_start = proc_status_kb(xkey_pid, "VmRSS");
+
+    Window root = DefaultRootWindow(d);
+    KeyCode kc = XKeysymToKeycode(d, BENCH_KEYSYM);
+    Window live[LIVE_MAX];
+    int nlive = 0;
+
+    // Keys go to the focus window only while the pointer is outside it
+    XWarpPointer(d, None, root, 0, 0, 0, 0, 1279, 1023);
+    double cpu0 = proc_cpu_ms(xkey_pid);
+
+    for (int i = 0; i < o->churn; i++)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "churn-%05d", i);
+        Window w = create_window(d, name, 1000, 0, i % (o->max_depth + 1));
+        XSync(d, False);
+        if (o->settle_us)
+            usleep((useconds_t)o->settle_us);
+
+        XSetInputFocus(d, w, RevertToParent, CurrentTime);
+        if (o->ewmh)
+            XChangeProperty(d, root, atom_active_window, XA_WINDOW, 32, PropModeReplace,
+                            (unsigned char *)&w, 1);
+        XSync(d, False);
+        if (o->settle_us)
+            usleep((useconds_t)o->settle_us);
+        XTestFakeKeyEvent(d, kc, True, CurrentTime);
+        XTestFakeKeyEvent(d, kc, False, CurrentTime);
+        XSync(d, False);
+
+        if (nlive == o->live)
+        {
+            XUnmapWindow(d, live[0]);
+            XDestroyWindow(d, live[0]);
+            memmove(live, live + 1, (size_t)(nlive - 1) * sizeof(*live));
+            nlive--;
+        }
+        live[nlive++] = w;
+    }
+    for (int i = 0; i < nlive; i++)
+    {
+        XUnmapWindow(d, live[i]);
+        XDestroyWindow(d, live[i]);
+    }
+    if (o->ewmh)
+        XDeleteProperty(d, root, atom_active_window);
+    XSync(d, False);
+
+    // Let xkey catch up before reading its CPU time
+    usleep((useconds_t)o->drain_ms * 1000);
+    r->cpu_ms_churn = proc_cpu_ms(xkey_pid) - cpu0;
+    r->cpu_us_per_window = o->churn ? r->cpu_ms_churn * 1e3 / o->churn : 0.0;
+    r->rss_kb_end = proc_status_kb(xkey_pid, "VmRSS");
+    r->rss_hwm_kb = proc_status_kb(xkey_pid, "VmHWM");
+
+out:
+    // Stopping xkey flushes the log and appends a final stats dump
+    stop(xkey_pid);
+    if (!r->error)
+    {
+        r->startup_scan_ms = stats_scan_ms(stats_path);
+        r->captured = count_captured(log_path, o->churn);
+    }
+
+    free(argv);
+    unlink(log_path);
+    unlink(stats_path);
+    unlink(cfg_path);
+    rmdir(dir);
+}
+
+// Memory per window over the smallest tree, for each backend
+static void rss_growth(void)
+{
+    for (int i = 0; i < nresults; i++)
+    {
+        struct result *r = &results[i];
+        for (int k = 0; k < i; k++)
+        {
+            const struct result *base = &results[k];
+            if (strcmp(base->backend, r->backend) != 0 || base->error || r->error)
+                continue;
+            if (r->tree_windows > base->tree_windows)
+                r->rss_bytes_per_window = (r->rss_kb_start - base->rss_kb_start) * 1024.0 /
+                                          (r->tree_windows - base->tree_windows);
+            break;
+        }
+    }
+}
+
+static void print_result(const struct result *r)
+{
+    printf("%-6s windows=%d (%d in tree)\n", r->backend, r->windows, r->tree_windows);
+    if (r->error)
+    {
+        printf("  error       %s\n", r->error);
+        return;
+    }
+    printf("  startup     scan %.1f ms, ready %.1f ms\n", r->startup_scan_ms, r->ready_ms);
+    printf("  rss         %ld kB after startup, %ld kB after churn (peak %ld kB)",
+           r->rss_kb_start, r->rss_kb_end, r->rss_hwm_kb);
+    if (r->rss_bytes_per_window >= 0)
+        printf(", %.0f B/window", r->rss_bytes_per_window);
+    printf("\n");
+    printf("  churn       %.1f ms cpu, %.1f us/window\n", r->cpu_ms_churn, r->cpu_us_per_window);
+    printf("  captured    %d of %d (missed %d)\n", r->captured, r->churn, r->churn - r->captured);
+    fflush(stdout);
+}
+
+/* --------------------------------------------------
+ * JSON output, and the --baseline gate that reads it
+ * back: one run per line, so a line scan is enough.
+ * -------------------------------------------------- */
+static void write_json(FILE *f, const struct bench_opts *o)
+{
+    fprintf(f, "{\n  \"bench\": \"xkey-churn\",\n");
+    fprintf(f, "  \"max_depth\": %d, \"churn\": %d, \"live\": %d, \"settle_us\": %d, \"ewmh\": %s,\n",
+            o->max_depth, o->churn, o->live, o->settle_us, o->ewmh ? "true" : "false");
+    fprintf(f, "  \"runs\": [\n");
+    for (int i = 0; i < nresults; i++)
+    {
+        const struct result *r = &results[i];
+        fprintf(f, "    {\"backend\": \"%s\", \"windows\": %d, \"tree_windows\": %d, ",
+                r->backend, r->windows, r->tree_windows);
+        if (r->error)
+            fprintf(f, "\"error\": \"%s\"", r->error);
+        else
+        {
+            fprintf(f, "\"startup_scan_ms\": %.3f, \"ready_ms\": %.3f, ", r->startup_scan_ms, r->ready_ms);
+            fprintf(f, "\"rss_kb_start\": %ld, \"rss_kb_end\": %ld, \"rss_hwm_kb\": %ld, ",
+                    r->rss_kb_start, r->rss_kb_end, r->rss_hwm_kb);
+            if (r->rss_bytes_per_window >= 0)
+                fprintf(f, "\"rss_bytes_per_window\": %.1f, ", r->rss_bytes_per_window);
+            else
+                fprintf(f, "\"rss_bytes_per_window\": null, ");
+            fprintf(f, "\"cpu_ms_churn\": %.3f, \"cpu_us_per_window\": %.3f, ", r->cpu_ms_churn,
+                    r->cpu_us_per_window);
+            fprintf(f, "\"churn\": %d, \"captured\": %d, \"missed\": %d", r->churn, r->captured,
+                    r->churn - r->captured);
+        }
+        fprintf(f, "}%s\n", i + 1 < nresults ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+}
+
+// Number after "key": in `line', or `dflt'
+static double json_num(const char *line, const char *key, double dflt)
+{
+    char pat[64];
+    snprintf(pat, sizeof(pat), "\"%s\": ", key);
+    const char *p = strstr(line, pat);
+    if (!p)
+        return dflt;
+    char *end;
+    double v = strtod(p + strlen(pat), &end);
+    return end == p + strlen(pat) ? dflt : v;
+}
+
+/*
+ * `what' of `r' against the baseline, `slack' being
+ * noise too small to count. Returns 1 on a regression.
+ */
+static int check(const struct result *r, const char *what, double base, double cur, double slack,
+                 double pct, int higher_is_worse)
+{
+    double limit = higher_is_worse ? base * (1 + pct / 100) + slack : base * (1 - pct / 100) - slack;
+    if (higher_is_worse ? cur <= limit : cur >= limit)
+        return 0;
+    printf("REGRESSION %s windows=%d %s %.3f -> %.3f", r->backend, r->windows, what, base, cur);
+    if (base != 0)
+        printf(" (%+.0f%%)", (cur - base) * 100 / base);
+    printf("\n");
+    return 1;
+}
+
+static FILE *baseline_open(const struct bench_opts *o)
+{
+    FILE *f = fopen(o->baseline, "r");
+    if (!f)
+    {
+        perror(o->baseline);
+        exit(1);
+    }
+    return f;
+}
+
+/*
+ * Before any run: the numbers only compare for the same
+ * tree shape and churn.
+ */
+static void baseline_check(const struct bench_opts *o)
+{
+    FILE *f = baseline_open(o);
+    char line[4096];
+    int max_depth = -1, churn = -1;
+
+    while (fgets(line, sizeof(line), f))
+    {
+        if (strstr(line, "\"max_depth\": "))
+        {
+            max_depth = (int)json_num(line, "max_depth", -1);
+            churn = (int)json_num(line, "churn", -1);
+            break;
+        }
+    }
+    fclose(f);
+
+    if (max_depth != o->max_depth || churn != o->churn)
+    {
+        fprintf(stderr, "xkey-churn: %s has max_depth=%d churn=%d, this run %d and %d\n", o->baseline,
+                max_depth, churn, o->max_depth, o->churn);
+        exit(1);
+    }
+}
+
+/*
+ * A run that failed now, or a run of the baseline that
+ * was not repeated, counts as a regression: a gate that
+ * only compares what happened to work proves nothing.
+ */
+static int gate(const struct bench_opts *o)
+{
+    FILE *f = baseline_open(o);
+    char line[4096];
+    int regressions = 0, compared = 0;
+    while (fgets(line, sizeof(line), f))
+    {
+        const char *p = strstr(line, "\"backend\": \"");
+        if (!p || strstr(line, "\"error\""))
+            continue;
+        p += strlen("\"backend\": \"");
+        int windows = (int)json_num(line, "windows", -1);
+
+        const struct result *r = NULL;
+        for (int i = 0; i < nresults && !r; i++)
+        {
+            size_t n = strlen(results[i].backend);
+            if (results[i].windows == windows && strncmp(p, results[i].backend, n) == 0 && p[n] == '"')
+                r = &results[i];
+        }
+        if (!r)
+        {
+            printf("REGRESSION %.*s windows=%d not run\n", (int)strcspn(p, "\""), p, windows);
+            regressions++;
+            continue;
+        }
+        if (r->error)
+            continue; // counted below
+
+        double pct = o->max_regress;
+        regressions += check(r, "startup_scan_ms", json_num(line, "startup_scan_ms", 0),
+                             r->startup_scan_ms, 1.0, pct, 1);
+        regressions += check(r, "cpu_us_per_window", json_num(line, "cpu_us_per_window", 0),
+                             r->cpu_us_per_window, 20.0, pct, 1);
+        regressions += check(r, "rss_kb_end", json_num(line, "rss_kb_end", 0), r->rss_kb_end,
+                             1024.0, pct, 1);
+        regressions += check(r, "captured", json_num(line, "captured", 0), r->captured, 0.0,
+                             pct, 0);
+        compared++;
+    }
+    fclose(f);
+
+    for (int i = 0; i < nresults; i++)
+    {
+        if (!results[i].error)
+            continue;
+        printf("REGRESSION %s windows=%d %s\n", results[i].backend, results[i].windows,
+               results[i].error);
+        regressions++;
+    }
+
+    printf("baseline    %d runs compared, %d regressions\n", compared, regressions);
+    return regressions ? 2 : 0;
+}
+
+static void parse_sizes(struct bench_opts *o, const char *arg)
+{
+    char *copy = strdup(arg), *save = NULL;
+    o->nsizes = 0;
+    for (char *t = strtok_r(copy, ",", &save); t; t = strtok_r(NULL, ",", &save))
+    {
+        if (o->nsizes == MAX_SIZES)
+        {
+            fprintf(stderr, "xkey-churn: at most %d sizes\n", MAX_SIZES);
+            exit(1);
+        }
+        o->sizes[o->nsizes++] = atoi(t);
+    }
+    free(copy);
+}
+
+static void parse_backends(struct bench_opts *o, const char *arg)
+{
+    char *copy = strdup(arg), *save = NULL;
+    memset(o->run_backend, 0, sizeof(o->run_backend));
+    for (char *t = strtok_r(copy, ",", &save); t; t = strtok_r(NULL, ",", &save))
+    {
+        int k = 0;
+        while (k < NBACKENDS && strcmp(t, backends[k].name) != 0)
+            k++;
+        if (k == NBACKENDS)
+        {
+            fprintf(stderr, "xkey-churn: unknown backend '%s'\n", t);
+            exit(1);
+        }
+        o->run_backend[k] = 1;
+    }
+    free(copy);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [options] [-- xkey options]\n", prog);
+    fprintf(stderr, "  --xkey=PATH        xkey binary (default ./xkey)\n");
+    fprintf(stderr, "  --display=:N       display for the private Xvfb (default :99)\n");
+    fprintf(stderr, "  --sizes=N,...      top-level windows at startup (default 10,100,1000,10000)\n");
+    fprintf(stderr, "  --max-depth=D      nested children per window, 0..D (default 3)\n");
+    fprintf(stderr, "  --backends=B,...   scan, track, xi2 (default all)\n");
+    fprintf(stderr, "  --churn=N          windows created after startup (default 500)\n");
+    fprintf(stderr, "  --live=K           churn windows kept mapped at once (default 8, max %d)\n", LIVE_MAX);
+    fprintf(stderr, "  --settle-us=T      pause after mapping and after focusing (default 2000)\n");
+    fprintf(stderr, "  --drain-ms=T       wait for xkey after the churn (default 1000)\n");
+    fprintf(stderr, "  --timeout=S        give up on an xkey startup after S s (default 120)\n");
+    fprintf(stderr, "  --no-ewmh          do not set _NET_CLIENT_LIST / _NET_ACTIVE_WINDOW\n");
+    fprintf(stderr, "  --json=FILE        write the results as JSON (- for stdout)\n");
+    fprintf(stderr, "  --baseline=FILE    compare with an earlier --json, exit 2 on regression\n");
+    fprintf(stderr, "  --max-regress=PCT  allowed change against the baseline (default 25)\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_opts o = {
+        .xkey = "./xkey",
+        .display = ":99",
+        .sizes = {10, 100, 1000, 10000},
+        .nsizes = 4,
+        .max_depth = 3,
+        .churn = 500,
+        .live = 8,
+        .settle_us = 2000,
+        .drain_ms = 1000,
+        .timeout_s = 120,
+        .ewmh = 1,
+        .run_backend = {1, 1, 1},
+        .max_regress = 25.0,
+    };
+
+    static const struct option long_opts[] = {
+        {"xkey", required_argument, NULL, 'x'},
+        {"display", required_argument, NULL, 'd'},
+        {"sizes", required_argument, NULL, 's'},
+        {"max-depth", required_argument, NULL, 'D'},
+        {"backends", required_argument, NULL, 'b'},
+        {"churn", required_argument, NULL, 'c'},
+        {"live", required_argument, NULL, 'l'},
+        {"settle-us", required_argument, NULL, 'u'},
+        {"drain-ms", required_argument, NULL, 't'},
+        {"timeout", required_argument, NULL, 'T'},
+        {"no-ewmh", no_argument, NULL, 'E'},
+        {"json", required_argument, NULL, 'j'},
+        {"baseline", required_argument, NULL, 'B'},
+        {"max-regress", required_argument, NULL, 'r'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", long_opts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'x':
+            o.xkey = optarg;
+            break;
+        case 'd':
+            o.display = optarg;
+            break;
+        case 's':
+            parse_sizes(&o, optarg);
+            break;
+        case 'D':
+            o.max_depth = atoi(optarg);
+            break;
+        case 'b':
+            parse_backends(&o, optarg);
+            break;
+        case 'c':
+            o.churn = atoi(optarg);
+            break;
+        case 'l':
+            o.live = atoi(optarg);
+            break;
+        case 'u':
+            o.settle_us = atoi(optarg);
+            break;
+        case 't':
+            o.drain_ms = atoi(optarg);
+            break;
+        case 'T':
+            o.timeout_s = atoi(optarg);
+            break;
+        case 'E':
+            o.ewmh = 0;
+            break;
+        case 'j':
+            o.json = optarg;
+            break;
+        case 'B':
+            o.baseline = optarg;
+            break;
+        case 'r':
+            o.max_regress = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            exit(opt == 'h' ? 0 : 1);
+        }
+    }
+    o.xkey_args = argv + optind;
+    o.xkey_nargs = argc - optind;
+
+    int bad = o.nsizes == 0 || o.max_depth < 0 || o.churn < 0 || o.live < 1 || o.live > LIVE_MAX ||
+              o.settle_us < 0 || o.drain_ms < 0 || o.timeout_s < 1;
+    for (int i = 0; i < o.nsizes; i++)
+        bad |= o.sizes[i] < 1;
+    if (bad)
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    if (o.baseline)
+        baseline_check(&o);
+
+    pid_t xvfb;
+    Display *d = start_xvfb("xkey-churn", o.display, &xvfb);
+
+    int ev, err, major, minor;
+    if (!XTestQueryExtension(d, &ev, &err, &major, &minor))
+    {
+        fprintf(stderr, "xkey-churn: Xvfb has no XTEST extension\n");
+        stop(xvfb);
+        exit(1);
+    }
+    atom_client_list = XInternAtom(d, "_NET_CLIENT_LIST", False);
+    atom_active_window = XInternAtom(d, "_NET_ACTIVE_WINDOW", False);
+
+    for (int s = 0; s < o.nsizes; s++)
+    {
+        int tree_windows;
+        Window *tops = create_tree(d, o.sizes[s], o.max_depth, o.ewmh, &tree_windows);
+        for (int k = 0; k < NBACKENDS; k++)
+        {
+            if (o.run_backend[k])
+                run(d, &o, &backends[k], o.sizes[s], tree_windows);
+        }
+        destroy_tree(d, tops, o.sizes[s]);
+    }
+
+    XCloseDisplay(d);
+    stop(xvfb);
+
+    rss_growth();
+    for (int i = 0; i < nresults; i++)
+        print_result(&results[i]);
+
+    // Before --json, which may overwrite the baseline
+    int status = o.baseline ? gate(&o) : 0;
+    if (o.json)
+    {
+        FILE *f = strcmp(o.json, "-") == 0 ? stdout : fopen(o.json, "w");
+        if (!f)
+        {
+            perror(o.json);
+            exit(1);
+        }
+        write_json(f, &o);
+        if (f != stdout)
+            fclose(f);
+    }
+    return status;
+}
@@ -0,0 +1,401 @@
+/*
+ * Usage Example:
+ *    gcc -o xkey-dump xkey-dump.c -lX11
+ *    gcc -DXKEY_ZSTD -o xkey-dump xkey-dump.c -lX11 -lzstd
+ *    gcc -DXKEY_XKBCOMMON -o xkey-dump xkey-dump.c -lX11 -lxkbcommon   (UTF-8 for every keysym)
+ *    ./xkey-dump keylog.bin > keylog.txt
+ *    ./xkey-dump --from="2024-05-01 09:00:00" --to="2024-05-01 10:00:00" keylog.000007.zst
+ *    ./xkey-dump --timing keylog.bin > timing.tsv
+ *
+ * Renders a binary log written by `xkey --format=binary'
+ * back into the same text xkey writes to keylog.txt
+ * (including --aggregate summaries). Keys are rebuilt
+ * from their keysym alone, so Ctrl combinations and
+ * dead / compose sequences print as their plain keysyms
+ * rather than as XLookupString() translated them (see
+ * xkeylog_render_key() in xkeylog.h).
+ * --from / --to (local "YYYY-mm-dd HH:MM:SS" or epoch
+ * seconds) keep only records in that time range; for a
+ * compressed segment only the frames that overlap it
+ * are decompressed. --timing prints the key dwell /
+ * flight records of `xkey --timing' instead, one
+ * tab-separated line per key release. No X display is
+ * needed.
+ */
+
+#define _GNU_SOURCE // strptime(), fmemopen()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <time.h>
+#include <X11/Xlib.h>
+#include <X11/keysym.h>
+
+#include "xkeylog.h"
+#ifdef XKEY_ZSTD
+#include <zstd.h>
+#endif
+
+// --from / --to as wall-clock nanoseconds
+static int64_t range_from = INT64_MIN, range_to = INT64_MAX;
+static int timing_only = 0;
+
+/* --------------------------------------------------
+ * String table, rebuilt from the XKEYLOG_NAME entries
+ * as they are read.
+ * -------------------------------------------------- */
+static char **names = NULL;
+static uint32_t names_cap = 0;
+
+static void set_name(uint32_t id, char *name)
+{
+    if (id >= names_cap)
+    {
+        uint32_t cap = names_cap ? names_cap : 64;
+        while (cap <= id)
+            cap *= 2;
+        names = realloc(names, cap * sizeof(*names));
+        memset(names + names_cap, 0, (cap - names_cap) * sizeof(*names));
+        names_cap = cap;
+    }
+    free(names[id]);
+    names[id] = name;
+}
+
+static const char *get_name(uint32_t id)
+{
+    if (id < names_cap && names[id])
+        return names[id];
+    return "";
+}
+
+static int64_t record_wall_ns(const struct xkeylog_header *hdr, uint64_t ts_ns)
+{
+    return (int64_t)hdr->wall_anchor_ns + ((int64_t)ts_ns - (int64_t)hdr->mono_anchor_ns);
+}
+
+/* --------------------------------------------------
+ * --aggregate summaries, in xkey's text form.
+ * -------------------------------------------------- */
+static void dump_summary(const struct xkeylog_header *hdr, const struct xkeylog_summary *sum,
+                         const struct xkeylog_summary_window *win, FILE *out)
+{
+    uint64_t ns = sum->end_ts_ns - sum->start_ts_ns;
+    char p50[16], p90[16];
+
+    xkeylog_iki_str(p50, sizeof(p50), sum->iki, 0.50);
+    xkeylog_iki_str(p90, sizeof(p90), sum->iki, 0.90);
+    fprintf(out, "\n[%s] Summary: keys=%u chars=%u wpm=%.1f backspace=%.1f%% iki_p50=%s iki_p90=%s\n",
+            xkeylog_format_time(record_wall_ns(hdr, sum->end_ts_ns)), sum->keys, sum->chars, xkeylog_wpm(sum->chars, ns),
+            xkeylog_percent(sum->backspaces, sum->keys), p50, p90);
+    for (unsigned int i = 0; i < sum->nwindows; i++)
+    {
+        fprintf(out, "  keys=%u chars=%u wpm=%.1f backspace=%.1f%% %s\n",
+                win[i].keys, win[i].chars, xkeylog_wpm(win[i].chars, ns),
+                xkeylog_percent(win[i].backspaces, win[i].keys),
+                win[i].name_id == XKEYLOG_NO_NAME ? "" : get_name(win[i].name_id));
+    }
+}
+
+// time, keycode, dwell ms, flight ms ("-" if unknown), window
+static void dump_timing(const struct xkeylog_header *hdr, const struct xkeylog_timing *t, FILE *out)
+{
+    int64_t wall = record_wall_ns(hdr, t->ts_ns);
+
+    fprintf(out, "%s.%03d\t%u\t%.3f\t", xkeylog_format_time(wall),
+            (int)(wall / 1000000 % 1000), t->keycode, t->dwell_us / 1e3);
+    if (t->flight_us == XKEYLOG_NO_FLIGHT)
+        fprintf(out, "-");
+    else
+        fprintf(out, "%.3f", t->flight_us / 1e3);
+    fprintf(out, "\t%s\n", get_name(t->name_id));
+}
+
+/*
+ * Render the entries in `in' (positioned just past the
+ * header, or at an entry boundary of a compressed
+ * frame). Name entries are always read; records only
+ * shown if they are in the requested range.
+ */
+static int dump_entries(FILE *in, const struct xkeylog_header *hdr, FILE *out)
+{
+    int type;
+    while ((type = fgetc(in)) != EOF)
+    {
+        // Zero tail of a mapped segment that was not closed
+        if (type == 0)
+            break;
+        ungetc(type, in);
+
+        if (type == XKEYLOG_NAME)
+        {
+            struct xkeylog_name ent;
+            if (fread(&ent, sizeof(ent), 1, in) != 1)
+                break;
+
+            size_t padded = XKEYLOG_NAME_PAD(ent.len);
+            char *name = malloc(padded + 1);
+            if (!name || fread(name, 1, padded, in) != padded)
+            {
+                free(name);
+                break;
+            }
+            name[ent.len] = '\0';
+            set_name(ent.id, name);
+            continue;
+        }
+
+        if (type == XKEYLOG_SUMMARY)
+        {
+            struct xkeylog_summary sum;
+            static struct xkeylog_summary_window win[UINT16_MAX];
+            if (fread(&sum, sizeof(sum), 1, in) != 1 ||
+                fread(win, sizeof(*win), sum.nwindows, in) != sum.nwindows)
+                break;
+
+            int64_t wall = record_wall_ns(hdr, sum.end_ts_ns);
+            if (!timing_only && wall >= range_from && wall <= range_to)
+                dump_summary(hdr, &sum, win, out);
+            continue;
+        }
+
+        struct xkeylog_record r;
+        if (fread(&r, sizeof(r), 1, in) != 1)
+            break;
+
+        int64_t wall = record_wall_ns(hdr, r.ts_ns);
+        if (wall < range_from || wall > range_to)
+            continue;
+
+        if (timing_only)
+        {
+            if (r.type == XKEYLOG_TIMING)
+                dump_timing(hdr, (const struct xkeylog_timing *)&r, out);
+        }
+        else if (r.type == XKEYLOG_TIMING)
+        {
+            // Not part of the text log
+        }
+        else if (r.type == XKEYLOG_FOCUS)
+        {
+            fprintf(out, "\n[%s] FocusIn: %s\n", xkeylog_format_time(record_wall_ns(hdr, r.ts_ns)), get_name(r.name_id));
+        }
+        else if (r.type == XKEYLOG_KEY)
+        {
+            char key[256];
+            xkeylog_render_key(&r, hdr->flags & XKEYLOG_XKBCOMMON, key, sizeof(key));
+            fputs(key, out);
+        }
+        else
+        {
+            fprintf(stderr, "xkey-dump: unknown record type %d\n", r.type);
+            return 1;
+        }
+    }
+
+    if (ferror(in))
+    {
+        perror("xkey-dump");
+        return 1;
+    }
+    return 0;
+}
+
+static int check_header(const struct xkeylog_header *hdr)
+{
+    if (memcmp(hdr->magic, XKEYLOG_MAGIC, sizeof(hdr->magic)) != 0)
+    {
+        fprintf(stderr, "xkey-dump: not an xkey binary log\n");
+        return 0;
+    }
+    if (hdr->version != XKEYLOG_VERSION || hdr->record_size != sizeof(struct xkeylog_record))
+    {
+        fprintf(stderr, "xkey-dump: unsupported log version %u\n", hdr->version);
+        return 0;
+    }
+    return 1;
+}
+
+static int dump(FILE *in, FILE *out)
+{
+    struct xkeylog_header hdr;
+
+    if (fread(&hdr, sizeof(hdr), 1, in) != 1)
+    {
+        fprintf(stderr, "xkey-dump: not an xkey binary log\n");
+        return 1;
+    }
+    if (!check_header(&hdr))
+        return 1;
+
+    if (!timing_only)
+        fprintf(out, "Keylogger started\n");
+    return dump_entries(in, &hdr, out);
+}
+
+#ifdef XKEY_ZSTD
+/*
+ * A compressed segment: load the seek table from the
+ * end of the file, then decompress only the frames
+ * whose records overlap the range.
+ */
+static int dump_zst(FILE *in, FILE *out)
+{
+    struct xkeylog_seek_footer foot;
+    struct xkeylog_header hdr;
+
+    if (fseek(in, -(long)sizeof(foot), SEEK_END) != 0 || fread(&foot, sizeof(foot), 1, in) != 1 ||
+        memcmp(foot.magic, XKEYLOG_SEEK_FOOTER_MAGIC, sizeof(foot.magic)) != 0)
+    {
+        fprintf(stderr, "xkey-dump: no seek table\n");
+        return 1;
+    }
+
+    long table = (long)(sizeof(hdr) + foot.nframes * sizeof(struct xkeylog_seek_entry) +
+                        foot.names_len + sizeof(foot));
+    struct xkeylog_seek_entry *frames = malloc(foot.nframes * sizeof(*frames) + 1);
+    char *names = malloc(foot.names_len + 1);
+    if (!frames || !names || fseek(in, -table, SEEK_END) != 0 ||
+        fread(&hdr, sizeof(hdr), 1, in) != 1 ||
+        fread(frames, sizeof(*frames), foot.nframes, in) != foot.nframes ||
+        fread(names, 1, foot.names_len, in) != foot.names_len)
+    {
+        fprintf(stderr, "xkey-dump: truncated seek table\n");
+        return 1;
+    }
+    if (!foot.binary && (range_from != INT64_MIN || range_to != INT64_MAX))
+        fprintf(stderr, "xkey-dump: text log, --from/--to ignored\n");
+    if (foot.binary)
+    {
+        if (!check_header(&hdr))
+            return 1;
+        FILE *nf = fmemopen(names, foot.names_len, "rb");
+        if (nf)
+        {
+            dump_entries(nf, &hdr, out);
+            fclose(nf);
+        }
+        if (!timing_only)
+            fprintf(out, "Keylogger started\n");
+    }
+
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    int rc = 0;
+    long off = 0;
+    for (uint32_t i = 0; i < foot.nframes && !rc; off += frames[i].c_size, i++)
+    {
+        const struct xkeylog_seek_entry *fe = &frames[i];
+        if (foot.binary && (fe->first_ts_ns > fe->last_ts_ns ||
+                            record_wall_ns(&hdr, fe->last_ts_ns) < range_from ||
+                            record_wall_ns(&hdr, fe->first_ts_ns) > range_to))
+            continue;
+
+        char *src = malloc(fe->c_size), *dst = malloc(fe->d_size + 1);
+        size_t n = 0;
+        if (!src || !dst || fseek(in, off, SEEK_SET) != 0 ||
+            fread(src, 1, fe->c_size, in) != fe->c_size ||
+            ZSTD_isError(n = ZSTD_decompressDCtx(dctx, dst, fe->d_size, src, fe->c_size)))
+        {
+            fprintf(stderr, "xkey-dump: bad frame %u\n", i);
+            rc = 1;
+        }
+        else if (!foot.binary)
+        {
+            fwrite(dst, 1, n, out);
+        }
+        else
+        {
+            // The first frame starts with the segment header
+            size_t skip = i == 0 ? sizeof(hdr) : 0;
+            FILE *ff = n > skip ? fmemopen(dst + skip, n - skip, "rb") : NULL;
+            if (ff)
+            {
+                rc = dump_entries(ff, &hdr, out);
+                fclose(ff);
+            }
+        }
+        free(src);
+        free(dst);
+    }
+
+    ZSTD_freeDCtx(dctx);
+    free(frames);
+    free(names);
+    return rc;
+}
+#endif
+
+int main(int argc, char **argv)
+{
+    static const struct option long_opts[] = {
+        {"from", required_argument, NULL, 'f'},
+        {"to", required_argument, NULL, 't'},
+        {"timing", no_argument, NULL, 'T'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "f:t:", long_opts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'f':
+        case 't':
+        {
+            int64_t t = xkeylog_parse_time(optarg);
+            if (t == INT64_MIN)
+            {
+                fprintf(stderr, "xkey-dump: bad time: %s\n", optarg);
+                exit(1);
+            }
+            if (opt == 'f')
+                range_from = t;
+            else
+                range_to = t + 999999999ll; // inclusive: the whole last second
+            break;
+        }
+        case 'T':
+            timing_only = 1;
+            break;
+        default:
+            optind = argc + 1;
+        }
+    }
+
+    if (optind != argc - 1)
+    {
+        fprintf(stderr, "Usage: %s [--from=TIME] [--to=TIME] [--timing] <keylog.bin | keylog.NNNNNN[.zst]>\n",
+                argv[0]);
+        fprintf(stderr, "Keys are rebuilt from their keysym: Ctrl and dead/compose combinations are approximated.\n");
+        exit(1);
+    }
+
+    const char *path = argv[optind];
+    FILE *in = fopen(path, "rb");
+    if (!in)
+    {
+        perror(path);
+        exit(1);
+    }
+
+    int rc;
+    size_t plen = strlen(path);
+    if (plen > 4 && strcmp(path + plen - 4, ".zst") == 0)
+    {
+#ifdef XKEY_ZSTD
+        rc = dump_zst(in, stdout);
+#else
+        fprintf(stderr, "xkey-dump: built without -DXKEY_ZSTD\n");
+        rc = 1;
+#endif
+    }
+    else
+    {
+        rc = dump(in, stdout);
+    }
+    fclose(in);
+    return rc;
+}
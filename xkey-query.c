@@ -0,0 +1,440 @@
+/*
+ * Usage Example:
+ *    gcc -o xkey-query xkey-query.c -lX11
+ *    gcc -DXKEY_XKBCOMMON -o xkey-query xkey-query.c -lX11 -lxkbcommon
+ *    ./xkey-query --from="2024-05-01 14:00:00" --to="2024-05-01 14:10:00" keylog.txt
+ *    ./xkey-query --window=Firefox keylog.000003 keylog.000004
+ *
+ * Range queries over logs written by `xkey --index':
+ * reads <log>.idx and seeks straight to the parts of the
+ * log that can hold what was asked for, in either
+ * format. --from / --to are as for xkey-dump; --window
+ * keeps only input typed into windows whose name
+ * contains the given string. Binary logs are filtered
+ * record by record; text logs have no per-key times and
+ * are cut at index points (every N records) and focus
+ * changes. A window that still has focus has no span
+ * yet. Compressed segments have no usable index; use
+ * xkey-dump --from / --to on those.
+ */
+
+#define _GNU_SOURCE // strptime()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <X11/Xlib.h>
+#include <X11/keysym.h>
+
+#include "xkeylog.h"
+
+// --from / --to as wall-clock nanoseconds
+static int64_t range_from = INT64_MIN, range_to = INT64_MAX;
+static const char *window_filter = NULL;
+
+/* --------------------------------------------------
+ * The index of one log.
+ * -------------------------------------------------- */
+struct index
+{
+    struct xkeylog_idx_header hdr;
+    char **names; // id -> title
+    uint32_t names_cap;
+    struct xkeylog_idx_seek *seeks;
+    size_t nseeks, seeks_cap;
+    struct xkeylog_idx_span *spans;
+    size_t nspans, spans_cap;
+};
+
+static void *grow(void *p, size_t *cap, size_t size)
+{
+    *cap = *cap ? *cap * 2 : 256;
+    p = realloc(p, *cap * size);
+    if (!p)
+    {
+        perror("realloc");
+        exit(1);
+    }
+    return p;
+}
+
+static void set_name(struct index *ix, uint32_t id, char *name)
+{
+    if (id >= ix->names_cap)
+    {
+        uint32_t cap = ix->names_cap ? ix->names_cap : 64;
+        while (cap <= id)
+            cap *= 2;
+        ix->names = realloc(ix->names, cap * sizeof(*ix->names));
+        memset(ix->names + ix->names_cap, 0, (cap - ix->names_cap) * sizeof(*ix->names));
+        ix->names_cap = cap;
+    }
+    free(ix->names[id]);
+    ix->names[id] = name;
+}
+
+static const char *get_name(const struct index *ix, uint32_t id)
+{
+    if (id < ix->names_cap && ix->names[id])
+        return ix->names[id];
+    return "";
+}
+
+// A name entry, its type byte still unread
+static int read_name(FILE *in, struct index *ix)
+{
+    struct xkeylog_name ent;
+    if (fread(&ent, sizeof(ent), 1, in) != 1)
+        return 0;
+
+    size_t padded = XKEYLOG_NAME_PAD(ent.len);
+    char *name = malloc(padded + 1);
+    if (!name || fread(name, 1, padded, in) != padded)
+    {
+        free(name);
+        return 0;
+    }
+    name[ent.len] = '\0';
+    set_name(ix, ent.id, name);
+    return 1;
+}
+
+static int load_index(const char *log_path, struct index *ix)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.idx", log_path);
+    FILE *in = fopen(path, "rb");
+    if (!in)
+    {
+        perror(path);
+        return 0;
+    }
+
+    if (fread(&ix->hdr, sizeof(ix->hdr), 1, in) != 1 ||
+        memcmp(ix->hdr.magic, XKEYLOG_IDX_MAGIC, sizeof(ix->hdr.magic)) != 0 ||
+        ix->hdr.version != XKEYLOG_IDX_VERSION)
+    {
+        fprintf(stderr, "xkey-query: %s: not an xkey index\n", path);
+        fclose(in);
+        return 0;
+    }
+
+    // A torn entry at the end (xkey still running) is ignored
+    int type;
+    while ((type = fgetc(in)) != EOF)
+    {
+        ungetc(type, in);
+        if (type == XKEYLOG_NAME)
+        {
+            if (!read_name(in, ix))
+                break;
+        }
+        else if (type == XKEYLOG_IDX_SEEK)
+        {
+            if (ix->nseeks == ix->seeks_cap)
+                ix->seeks = grow(ix->seeks, &ix->seeks_cap, sizeof(*ix->seeks));
+            if (fread(&ix->seeks[ix->nseeks], sizeof(*ix->seeks), 1, in) != 1)
+                break;
+            ix->nseeks++;
+        }
+        else if (type == XKEYLOG_IDX_SPAN)
+        {
+            if (ix->nspans == ix->spans_cap)
+                ix->spans = grow(ix->spans, &ix->spans_cap, sizeof(*ix->spans));
+            if (fread(&ix->spans[ix->nspans], sizeof(*ix->spans), 1, in) != 1)
+                break;
+            ix->nspans++;
+        }
+        else
+        {
+            fprintf(stderr, "xkey-query: %s: unknown entry type %d\n", path, type);
+            fclose(in);
+            return 0;
+        }
+    }
+    fclose(in);
+    return 1;
+}
+
+static void free_index(struct index *ix)
+{
+    for (uint32_t i = 0; i < ix->names_cap; i++)
+        free(ix->names[i]);
+    free(ix->names);
+    free(ix->seeks);
+    free(ix->spans);
+}
+
+static int64_t wall_ns(const struct index *ix, uint64_t ts_ns)
+{
+    return (int64_t)ix->hdr.wall_anchor_ns + ((int64_t)ts_ns - (int64_t)ix->hdr.mono_anchor_ns);
+}
+
+/* --------------------------------------------------
+ * Byte ranges of the log to read.
+ * -------------------------------------------------- */
+struct range
+{
+    uint64_t start, end;
+};
+
+// Last seek point at or before range_from (or the start)
+static uint64_t seek_floor(const struct index *ix)
+{
+    uint64_t off = 0;
+    for (size_t i = 0; i < ix->nseeks && wall_ns(ix, ix->seeks[i].ts_ns) <= range_from; i++)
+        off = ix->seeks[i].offset;
+    return off;
+}
+
+// First seek point after range_to (or the end)
+static uint64_t seek_ceil(const struct index *ix)
+{
+    for (size_t i = 0; i < ix->nseeks; i++)
+    {
+        if (wall_ns(ix, ix->seeks[i].ts_ns) > range_to)
+            return ix->seeks[i].offset;
+    }
+    return XKEYLOG_IDX_EOF;
+}
+
+static int window_matches(const struct index *ix, uint32_t name_id)
+{
+    return !window_filter || strstr(get_name(ix, name_id), window_filter);
+}
+
+/*
+ * The spans of matching windows that overlap the time
+ * range (the whole range without --window), clipped to
+ * the seek points around it, in log order and merged.
+ */
+static size_t query_ranges(const struct index *ix, struct range **out)
+{
+    uint64_t lo = seek_floor(ix), hi = seek_ceil(ix);
+    struct range *r = NULL;
+    size_t n = 0, cap = 0;
+
+    if (!window_filter)
+    {
+        r = grow(r, &cap, sizeof(*r));
+        r[n++] = (struct range){lo, hi};
+        *out = r;
+        return n;
+    }
+
+    for (size_t i = 0; i < ix->nspans; i++)
+    {
+        const struct xkeylog_idx_span *sp = &ix->spans[i];
+        if (!window_matches(ix, sp->name_id) || wall_ns(ix, sp->end_ts_ns) < range_from ||
+            wall_ns(ix, sp->start_ts_ns) > range_to)
+            continue;
+
+        struct range cur = {sp->start_offset > lo ? sp->start_offset : lo,
+                            sp->end_offset < hi ? sp->end_offset : hi};
+        if (cur.start >= cur.end)
+            continue;
+        if (n && cur.start <= r[n - 1].end)
+        {
+            if (cur.end > r[n - 1].end)
+                r[n - 1].end = cur.end;
+            continue;
+        }
+        if (n == cap)
+            r = grow(r, &cap, sizeof(*r));
+        r[n++] = cur;
+    }
+    *out = r;
+    return n;
+}
+
+/* --------------------------------------------------
+ * Output, the same as for xkey-dump.
+ * -------------------------------------------------- */
+static void copy_text(FILE *in, const struct range *r, FILE *out)
+{
+    char buf[65536];
+    uint64_t left = r->end - r->start;
+
+    if (fseeko(in, (off_t)r->start, SEEK_SET) != 0)
+        return;
+    while (left)
+    {
+        size_t n = fread(buf, 1, left < sizeof(buf) ? (size_t)left : sizeof(buf), in);
+        if (n == 0)
+            break;
+        fwrite(buf, 1, n, out);
+        left -= n;
+    }
+}
+
+static int dump_binary(FILE *in, struct index *ix, const struct range *r, int utf8, FILE *out)
+{
+    off_t pos = r->start ? (off_t)r->start : (off_t)sizeof(struct xkeylog_header);
+    if (fseeko(in, pos, SEEK_SET) != 0)
+        return 0;
+
+    int type;
+    while ((uint64_t)pos < r->end && (type = fgetc(in)) != EOF)
+    {
+        // Zero tail of a mapped segment that was not closed
+        if (type == 0)
+            break;
+        ungetc(type, in);
+
+        if (type == XKEYLOG_NAME)
+        {
+            if (!read_name(in, ix))
+                break;
+        }
+        else if (type == XKEYLOG_SUMMARY)
+        {
+            // --aggregate summaries are not input; xkey-dump shows them
+            struct xkeylog_summary sum;
+            if (fread(&sum, sizeof(sum), 1, in) != 1 ||
+                fseeko(in, (off_t)(sum.nwindows * sizeof(struct xkeylog_summary_window)), SEEK_CUR) != 0)
+                break;
+        }
+        else
+        {
+            struct xkeylog_record rec;
+            if (fread(&rec, sizeof(rec), 1, in) != 1)
+                break;
+
+            int64_t wall = wall_ns(ix, rec.ts_ns);
+            if (wall >= range_from && wall <= range_to && window_matches(ix, rec.name_id))
+            {
+                if (rec.type == XKEYLOG_FOCUS)
+                {
+                    fprintf(out, "\n[%s] FocusIn: %s\n", xkeylog_format_time(wall), get_name(ix, rec.name_id));
+                }
+                else if (rec.type == XKEYLOG_KEY)
+                {
+                    char key[256];
+                    xkeylog_render_key(&rec, utf8, key, sizeof(key));
+                    fputs(key, out);
+                }
+                else if (rec.type == XKEYLOG_TIMING)
+                {
+                    // Not input; xkey-dump --timing shows them
+                }
+                else
+                {
+                    fprintf(stderr, "xkey-query: unknown record type %d\n", rec.type);
+                    return 0;
+                }
+            }
+        }
+        pos = ftello(in);
+    }
+    return !ferror(in);
+}
+
+static int query(const char *path, FILE *out)
+{
+    size_t plen = strlen(path);
+    if (plen > 4 && strcmp(path + plen - 4, ".zst") == 0)
+    {
+        fprintf(stderr, "xkey-query: %s is compressed, use xkey-dump --from/--to\n", path);
+        return 1;
+    }
+
+    struct index ix;
+    memset(&ix, 0, sizeof(ix));
+    if (!load_index(path, &ix))
+    {
+        free_index(&ix);
+        return 1;
+    }
+
+    FILE *in = fopen(path, "rb");
+    if (!in)
+    {
+        perror(path);
+        free_index(&ix);
+        return 1;
+    }
+
+    // The log header says how its keys are rendered
+    struct xkeylog_header hdr;
+    if (ix.hdr.binary &&
+        (fread(&hdr, sizeof(hdr), 1, in) != 1 || memcmp(hdr.magic, XKEYLOG_MAGIC, sizeof(hdr.magic)) != 0 ||
+         hdr.version != XKEYLOG_VERSION))
+    {
+        fprintf(stderr, "xkey-query: %s: not a binary log of this version\n", path);
+        fclose(in);
+        free_index(&ix);
+        return 1;
+    }
+
+    struct range *ranges;
+    size_t n = query_ranges(&ix, &ranges);
+    int ok = 1;
+    for (size_t i = 0; i < n && ok; i++)
+    {
+        if (ix.hdr.binary)
+            ok = dump_binary(in, &ix, &ranges[i], hdr.flags & XKEYLOG_XKBCOMMON, out);
+        else
+            copy_text(in, &ranges[i], out);
+    }
+    if (!ok)
+        fprintf(stderr, "xkey-query: %s: read error\n", path);
+
+    free(ranges);
+    fclose(in);
+    free_index(&ix);
+    return !ok;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_opts[] = {
+        {"from", required_argument, NULL, 'f'},
+        {"to", required_argument, NULL, 't'},
+        {"window", required_argument, NULL, 'w'},
+        {NULL, 0, NULL, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "f:t:w:", long_opts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'f':
+        case 't':
+        {
+            int64_t t = xkeylog_parse_time(optarg);
+            if (t == INT64_MIN)
+            {
+                fprintf(stderr, "xkey-query: bad time: %s\n", optarg);
+                exit(1);
+            }
+            if (opt == 'f')
+                range_from = t;
+            else
+                range_to = t + 999999999ll; // inclusive: the whole last second
+            break;
+        }
+        case 'w':
+            window_filter = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [--from=TIME] [--to=TIME] [--window=NAME] <log>...\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind >= argc)
+    {
+        fprintf(stderr, "Usage: %s [--from=TIME] [--to=TIME] [--window=NAME] <log>...\n", argv[0]);
+        return 1;
+    }
+
+    int rc = 0;
+    for (int i = optind; i < argc; i++)
+        rc |= query(argv[i], stdout);
+    return rc;
+}
@@ -1,355 +1,5702 @@
 /*
  * Usage Example:
- *    gcc -o xkey xkey.c -lX11 -lm
+ *    gcc -o xkey xkey.c -lX11 -lm -pthread
+ *    gcc -DXKEY_XCB -o xkey xkey.c -lX11 -lX11-xcb -lxcb -lm -pthread
+ *    gcc -DXKEY_XI2 -o xkey xkey.c -lX11 -lXi -lm -pthread
+ *    gcc -DXKEY_XKBCOMMON -o xkey xkey.c -lX11 -lX11-xcb -lxcb \
+ *        -lxkbcommon -lxkbcommon-x11 -lm -pthread
+ *    gcc -DXKEY_URING -o xkey xkey.c -lX11 -lm -pthread
+ *    gcc -DXKEY_ZSTD -o xkey xkey.c -lX11 -lzstd -lm -pthread
  *    ./xkey :0
+ *    ./xkey :1 :2 :3            (one process, keylog-1.txt, keylog-2.txt, ...)
+ *    ./xkey --flush-bytes=8192 --flush-ms=500 --flush-on-focus :0
+ *    ./xkey --track :0
+ *    ./xkey --watch-config :0   (edit config.txt while running)
+ *    ./xkey --coalesce-ms=5 --skip-frames :0
+ *    ./xkey --format=binary :0  (read it back with xkey-dump)
+ *    ./xkey --segment-size=64M --segment-time=86400 :0
+ *    ./xkey --format=binary --segment-size=64M --writer=mmap --flush-ms=1000 :0
+ *    ./xkey --format=binary --segment-size=64M --compress=9 :0  (built with -DXKEY_ZSTD)
+ *    ./xkey --xi2 :0            (built with -DXKEY_XI2)
+ *    ./xkey --xkbcommon :0      (built with -DXKEY_XKBCOMMON)
+ *    ./xkey --stats-interval=60 --stats-file=xkey.stats :0  (or kill -USR1)
+ *    ./xkey --aggregate=60 :0   (per-minute WPM / backspace summaries, no keys)
+ *    ./xkey --index :0          (sidecar keylog.txt.idx, read by xkey-query)
+ *    ./xkey --timing --format=binary :0  (key dwell / flight, xkey-dump --timing)
  *
- * If there is at least one top-level window whose name contains "designate_name",
+ * config.txt lists designated window name patterns, one per line
+ * ("^" / "$" anchor them to the start / end of the name).
+ * If there is at least one window whose name matches one of them,
  * we ONLY capture KeyPress/FocusIn from that window (or those windows).
  * Otherwise, we capture from ALL top-level windows as before.
  */
 
+#define _GNU_SOURCE // fallocate()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 #include <string.h>
+#include <stdarg.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
 #include <X11/X.h>
 #include <X11/Xlib.h>
 #include <X11/Intrinsic.h>
 #include <X11/StringDefs.h>
 #include <X11/Xutil.h>
+#include <X11/Xatom.h>
 #include <X11/Shell.h>
+#include <X11/XKBlib.h>
+#include <X11/keysym.h>
+
+#include "xkeylog.h"
+#ifdef XKEY_ZSTD
+#include <sched.h>
+#include <zstd.h>
+#endif
+#ifdef XKEY_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#if defined(XKEY_XCB) || defined(XKEY_XKBCOMMON)
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
+#endif
+#ifdef XKEY_XKBCOMMON
+#include <xkbcommon/xkbcommon.h>
+#include <xkbcommon/xkbcommon-x11.h>
+#endif
+#ifdef XKEY_XI2
+#include <X11/extensions/XInput2.h>
+#endif
+
+Display *d;
+
+/* --------------------------------------------------
+ * Atoms used anywhere in xkey, resolved once at
+ * startup with a single XInternAtoms() round trip.
+ * -------------------------------------------------- */
+enum
+{
+    ATOM__NET_WM_NAME,
+    ATOM_UTF8_STRING,
+    ATOM__NET_CLIENT_LIST,
+    ATOM__NET_ACTIVE_WINDOW,
+    ATOM_WM_STATE,
+    ATOM_COUNT
+};
+
+static char *atom_names[ATOM_COUNT] = {
+    [ATOM__NET_WM_NAME] = "_NET_WM_NAME",
+    [ATOM_UTF8_STRING] = "UTF8_STRING",
+    [ATOM__NET_CLIENT_LIST] = "_NET_CLIENT_LIST",
+    [ATOM__NET_ACTIVE_WINDOW] = "_NET_ACTIVE_WINDOW",
+    [ATOM_WM_STATE] = "WM_STATE",
+};
+
+static Atom atoms[ATOM_COUNT];
+
+void intern_atoms(Display *disp)
+{
+    if (!XInternAtoms(disp, atom_names, ATOM_COUNT, False, atoms))
+    {
+        fprintf(stderr, "Cannot intern atoms\n");
+        exit(1);
+    }
+}
+
+// Set once SIGINT / SIGTERM arrived on the signalfd
+static int quit_requested = 0;
+
+/* --------------------------------------------------
+ * A small utility to safely format a local time
+ * as a string (YYYY-mm-dd HH:MM:SS).
+ * -------------------------------------------------- */
+void getTimeStr(time_t t, char *buf, size_t buflen)
+{
+    struct tm local_time;
+    if (t == (time_t)-1 || !localtime_r(&t, &local_time))
+    {
+        snprintf(buf, buflen, "UnknownTime");
+        return;
+    }
+
+    strftime(buf, buflen, "%Y-%m-%d %H:%M:%S", &local_time);
+}
+
+static uint32_t fnv1a(const char *str)
+{
+    uint32_t h = 2166136261u;
+    while (*str)
+        h = (h ^ (unsigned char)*str++) * 16777619u;
+    return h;
+}
+
+static uint32_t fnv1a_len(const char *str, size_t n)
+{
+    uint32_t h = 2166136261u;
+    while (n--)
+        h = (h ^ (unsigned char)*str++) * 16777619u;
+    return h;
+}
+
+/* --------------------------------------------------
+ * Timestamps.
+ *
+ * Records are stamped in CLOCK_MONOTONIC nanoseconds:
+ * key events from their X server time, everything
+ * else when it is read. Each log stream samples the
+ * wall clock into its own anchor when it is opened and
+ * again whenever one of its segments starts, and wall
+ * time is derived from it, so there is no
+ * time()/localtime() per event and a long segmented run
+ * follows NTP steps without one stream's roll moving
+ * the times of the others. A log (segment) and its
+ * index carry the anchor in force when they were
+ * started. Main thread until the writer runs, then the
+ * writer's.
+ * -------------------------------------------------- */
+struct clock_anchor
+{
+    uint64_t wall_ns; // CLOCK_REALTIME ...
+    uint64_t mono_ns; // ... at this CLOCK_MONOTONIC instant
+};
+
+static uint64_t start_ns; // for the uptime
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void clock_anchor_set(struct clock_anchor *ca)
+{
+    struct timespec ts;
+    ca->mono_ns = monotonic_ns();
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ca->wall_ns = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t mono_to_wall_ns(const struct clock_anchor *ca, uint64_t mono_ns)
+{
+    return ca->wall_ns + (mono_ns - ca->mono_ns);
+}
+
+/*
+ * Map an X server timestamp (ms, wraps every ~49 days)
+ * onto our monotonic clock. An event can only be read
+ * after it happened, so the smallest `now - server'
+ * seen so far is the best estimate of the offset.
+ * X thread only.
+ */
+static int64_t server_offset_ns;
+static int server_anchored = 0;
+static uint32_t server_last_ms;
+static uint64_t server_wraps;
+
+uint64_t server_time_ns(Time t)
+{
+    uint64_t now = monotonic_ns();
+    if (t == CurrentTime)
+        return now;
+
+    uint32_t ms = (uint32_t)t;
+    if (server_anchored && ms < server_last_ms && server_last_ms - ms > 0x80000000u)
+        server_wraps++;
+    server_last_ms = ms;
+
+    int64_t server_ns = (int64_t)(((server_wraps << 32) + ms) * 1000000ull);
+    int64_t offset = (int64_t)now - server_ns;
+    if (!server_anchored || offset < server_offset_ns)
+    {
+        server_offset_ns = offset;
+        server_anchored = 1;
+    }
+    return (uint64_t)(server_ns + server_offset_ns);
+}
+
+/*
+ * "YYYY-mm-dd HH:MM:SS" for a monotonic timestamp,
+ * through anchor `ca'. The string is only rebuilt when
+ * the second changes. Writer thread only.
+ */
+const char *wall_time_str(const struct clock_anchor *ca, uint64_t mono_ns)
+{
+    static time_t cached_sec = (time_t)-1;
+    static char cached[64] = "UnknownTime";
+
+    time_t sec = (time_t)(mono_to_wall_ns(ca, mono_ns) / 1000000000ull);
+    if (sec != cached_sec)
+    {
+        getTimeStr(sec, cached, sizeof(cached));
+        cached_sec = sec;
+    }
+    return cached;
+}
+
+/* --------------------------------------------------
+ * Instrumentation.
+ *
+ * Counters and log-linear (HDR-style) latency
+ * histograms for the hot path: 8 sub-buckets per power
+ * of two, so any percentile is within 12.5%. Each
+ * counter/histogram has a single writing thread; the
+ * dump (stats_dump()) may read while they are being
+ * updated and so gives a close snapshot, not an exact one.
+ * -------------------------------------------------- */
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS) * HIST_SUB + HIST_SUB)
+
+struct hist
+{
+    atomic_uint_least64_t counts[HIST_BUCKETS];
+    atomic_uint_least64_t total;
+    atomic_uint_least64_t max;
+};
+
+static inline void counter_add(atomic_uint_least64_t *c, uint64_t n)
+{
+    // Single writer: a plain load/store pair, no locked RMW
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+static unsigned int hist_index(uint64_t v)
+{
+    if (v < 2 * HIST_SUB)
+        return (unsigned int)v;
+    unsigned int e = 63 - (unsigned int)__builtin_clzll(v);
+    unsigned int sub = (unsigned int)(v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1);
+    return 2 * HIST_SUB + (e - HIST_SUB_BITS - 1) * HIST_SUB + sub;
+}
+
+// Lowest value that falls into bucket `i'
+static uint64_t hist_value(unsigned int i)
+{
+    if (i < 2 * HIST_SUB)
+        return i;
+    unsigned int e = (i - 2 * HIST_SUB) / HIST_SUB + HIST_SUB_BITS + 1;
+    uint64_t sub = (i - 2 * HIST_SUB) % HIST_SUB;
+    return (1ull << e) | (sub << (e - HIST_SUB_BITS));
+}
+
+void hist_add(struct hist *h, uint64_t v)
+{
+    counter_add(&h->counts[hist_index(v)], 1);
+    counter_add(&h->total, 1);
+    if (v > atomic_load_explicit(&h->max, memory_order_relaxed))
+        atomic_store_explicit(&h->max, v, memory_order_relaxed);
+}
+
+uint64_t hist_percentile(struct hist *h, double p)
+{
+    uint64_t total = atomic_load_explicit(&h->total, memory_order_relaxed);
+    uint64_t want = (uint64_t)(p * (double)total), seen = 0;
+
+    for (unsigned int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+        if (seen > want)
+            return hist_value(i);
+    }
+    return atomic_load_explicit(&h->max, memory_order_relaxed);
+}
+
+static struct
+{
+    // X thread
+    atomic_uint_least64_t events;
+    atomic_uint_least64_t keys;
+    atomic_uint_least64_t focus;
+    atomic_uint_least64_t name_hits;
+    atomic_uint_least64_t name_misses;
+    atomic_uint_least64_t name_epochs;
+    atomic_uint_least64_t scan_us; // startup: window scan / XI2 setup, all displays
+    struct hist x_to_enqueue; // X server time -> record staged
+    struct hist translate;    // keycode -> string
+    struct hist name_lookup;  // getWindowName() round trips
+    atomic_uint_least64_t repeats;
+    struct hist dwell;   // --timing: press -> release
+    struct hist flight;  // release -> next press
+    struct hist overlap; // next press -> release, keys held together
+
+    // writer thread
+    atomic_uint_least64_t flushes;
+    atomic_uint_least64_t bytes_written;
+    atomic_uint_least64_t segments;
+    struct hist enqueue_to_write; // record staged -> write() returned
+} stats;
+
+/* --------------------------------------------------
+ * Buffered log writer.
+ *
+ * Keeps keylog.txt open for the whole session and
+ * collects records in memory. The buffer is written
+ * out when one of the flush policies fires:
+ *   - flush_bytes:    this many bytes are pending
+ *   - flush_ms:       the oldest pending byte is this old
+ *   - flush_on_focus: a FocusIn record was appended
+ * and always on log_writer_close().
+ *
+ * With `seg_prefix' set the log is split into
+ * segments <prefix>.000000, <prefix>.000001, ...
+ * rolled at a record boundary once a segment reaches
+ * seg_size bytes or is seg_secs old. Numbering goes on
+ * from the segments already in the directory, so a
+ * restart never overwrites history. Each segment is
+ * preallocated (without changing its size, so a crash
+ * leaves no zero tail) and fsynced once when it is
+ * finished.
+ *
+ * The bytes go through a backend: "buffered" collects
+ * them in buf and write()s them out on flush, "mmap"
+ * (segments only) copies them straight into the mapped
+ * segment and a flush is an msync() of the new part.
+ * With -DXKEY_URING there is also "uring", which hands
+ * each flush to io_uring and does not wait for it.
+ * -------------------------------------------------- */
+#define LOG_BUFF_SIZE (64 * 1024)
+#define LOG_MARKS_MAX 4096
+
+// Upper bound of one record in either format
+#define LOG_RECORD_MAX 1024
+
+struct log_writer;
+
+struct log_backend
+{
+    const char *name;
+    int open_flags;
+    size_t reserve; // room a segment must keep for one more record
+    void (*open)(struct log_writer *lw); // segment fd just opened
+    void (*append)(struct log_writer *lw, const char *data, size_t n);
+    void (*flush)(struct log_writer *lw); // the `len' pending bytes
+    void (*close)(struct log_writer *lw); // segment done, before fsync
+};
+
+struct log_writer
+{
+    int fd;
+    const char *path;
+    const struct log_backend *backend;
+    char buf[LOG_BUFF_SIZE];
+    size_t len; // pending (not yet flushed) bytes
+
+    char *map; // mmap backend: the segment, `len' bytes past seg_written pending
+    size_t map_size;
+
+    size_t flush_bytes;
+    long flush_ms;
+    int flush_on_focus;
+
+    struct timespec first_pending; // when buf went from empty to non-empty
+
+    // Enqueue times of the records in buf, for stats.enqueue_to_write
+    uint64_t marks[LOG_MARKS_MAX];
+    size_t nmarks;
+
+    // Segmentation, off while seg_prefix is NULL
+    const char *seg_prefix;
+    size_t seg_size; // 0 = no size limit
+    long seg_secs;   // 0 = no age limit
+    unsigned long seg_index;
+    size_t seg_written;
+    uint64_t seg_opened_ns;
+    char seg_path[256];
+    void (*segment_start)(struct log_writer *lw); // writes per-segment headers
+    void (*segment_done)(const char *path);      // after a segment is closed
+};
+
+static long elapsed_ms(const struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000L +
+           (now.tv_nsec - since->tv_nsec) / 1000000L;
+}
+
+void log_writer_open(struct log_writer *lw, const char *path, int truncate)
+{
+    int flags = lw->backend->open_flags | O_CREAT | (truncate ? O_TRUNC : 0);
+
+    lw->fd = open(path, flags, 0644);
+    if (lw->fd < 0)
+    {
+        perror(path);
+        exit(1);
+    }
+    lw->path = path;
+    lw->len = 0;
+}
+
+void log_writer_flush(struct log_writer *lw)
+{
+    if (lw->len)
+    {
+        lw->backend->flush(lw);
+        counter_add(&stats.flushes, 1);
+        counter_add(&stats.bytes_written, lw->len);
+    }
+    lw->seg_written += lw->len;
+
+    uint64_t now = monotonic_ns();
+    for (size_t i = 0; i < lw->nmarks; i++)
+        hist_add(&stats.enqueue_to_write, now - lw->marks[i]);
+    lw->nmarks = 0;
+    lw->len = 0;
+}
+
+// Offset in the log (segment) of the next byte appended
+static uint64_t log_writer_offset(const struct log_writer *lw)
+{
+    return lw->seg_written + lw->len;
+}
+
+void log_writer_append(struct log_writer *lw, const char *data, size_t n)
+{
+    if (lw->len == 0)
+        clock_gettime(CLOCK_MONOTONIC, &lw->first_pending);
+
+    lw->backend->append(lw, data, n);
+
+    if (lw->flush_bytes && lw->len >= lw->flush_bytes)
+        log_writer_flush(lw);
+}
+
+static void buffered_append(struct log_writer *lw, const char *data, size_t n)
+{
+    while (n > 0)
+    {
+        size_t room = LOG_BUFF_SIZE - lw->len;
+        size_t chunk = n < room ? n : room;
+        memcpy(lw->buf + lw->len, data, chunk);
+        lw->len += chunk;
+        data += chunk;
+        n -= chunk;
+        if (lw->len == LOG_BUFF_SIZE)
+            log_writer_flush(lw);
+    }
+}
+
+static void buffered_flush(struct log_writer *lw)
+{
+    size_t off = 0;
+    while (off < lw->len)
+    {
+        ssize_t n = write(lw->fd, lw->buf + off, lw->len - off);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror(lw->path);
+            exit(1);
+        }
+        off += (size_t)n;
+    }
+}
+
+static const struct log_backend log_backend_buffered = {
+    .name = "buffered",
+    .open_flags = O_WRONLY | O_APPEND,
+    .append = buffered_append,
+    .flush = buffered_flush,
+};
+
+/*
+ * mmap backend. The segment is extended to seg_size
+ * and mapped; on close it is cut back to what was
+ * written. A crash leaves a zero-filled tail, which
+ * readers take as the end of the log.
+ */
+static void mmap_open(struct log_writer *lw)
+{
+    lw->map_size = lw->seg_size;
+    if (ftruncate(lw->fd, (off_t)lw->map_size) < 0)
+    {
+        perror(lw->path);
+        exit(1);
+    }
+    lw->map = mmap(NULL, lw->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, lw->fd, 0);
+    if (lw->map == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(1);
+    }
+}
+
+static void mmap_append(struct log_writer *lw, const char *data, size_t n)
+{
+    size_t pos = lw->seg_written + lw->len;
+
+    // Only if a record outgrew the reserve
+    if (pos + n > lw->map_size)
+    {
+        size_t size = lw->map_size;
+        while (size < pos + n)
+            size *= 2;
+        char *map = mremap(lw->map, lw->map_size, size, MREMAP_MAYMOVE);
+        if (map == MAP_FAILED || ftruncate(lw->fd, (off_t)size) < 0)
+        {
+            perror("mremap");
+            exit(1);
+        }
+        lw->map = map;
+        lw->map_size = size;
+    }
+
+    memcpy(lw->map + pos, data, n);
+    lw->len += n;
+}
+
+static void mmap_flush(struct log_writer *lw)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = lw->seg_written & ~(page - 1);
+
+    if (msync(lw->map + start, lw->seg_written + lw->len - start, MS_SYNC) < 0)
+        perror("msync");
+}
+
+static void mmap_close(struct log_writer *lw)
+{
+    munmap(lw->map, lw->map_size);
+    lw->map = NULL;
+    if (ftruncate(lw->fd, (off_t)lw->seg_written) < 0)
+        perror(lw->path);
+}
+
+static const struct log_backend log_backend_mmap = {
+    .name = "mmap",
+    .open_flags = O_RDWR,
+    .reserve = LOG_RECORD_MAX,
+    .open = mmap_open,
+    .append = mmap_append,
+    .flush = mmap_flush,
+    .close = mmap_close,
+};
+
+#ifdef XKEY_URING
+/*
+ * io_uring backend, on raw syscalls (no liburing).
+ *
+ * A flush copies the pending bytes into one of
+ * URING_BUFS in-flight buffers and queues a write at
+ * an explicit offset (so the fd is not O_APPEND and
+ * writes may complete in any order), then returns
+ * without waiting. The writer thread only blocks when
+ * all buffers are still in flight, i.e. when storage
+ * is more than URING_BUFS flushes behind. An fdatasync
+ * is queued behind the writes at most every
+ * URING_FSYNC_MS. Short writes are resubmitted.
+ */
+#define URING_BUFS 8
+#define URING_ENTRIES 32
+#define URING_FSYNC_MS 1000
+#define URING_FSYNC_TAG 0
+
+static struct
+{
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit;
+    unsigned inflight; // sqes submitted and not yet completed
+
+    char bufs[URING_BUFS][LOG_BUFF_SIZE];
+    size_t buf_len[URING_BUFS], buf_done[URING_BUFS];
+    uint64_t buf_off[URING_BUFS];
+    int buf_fd[URING_BUFS];
+    int busy[URING_BUFS];
+    uint64_t last_fsync_ns;
+} uring = {.fd = -1};
+
+/*
+ * Returns 0 (and the caller falls back to another
+ * backend) if the kernel has no io_uring.
+ */
+int uring_setup(void)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    uring.fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (uring.fd < 0)
+        return 0;
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    uring.fd, IORING_OFF_SQ_RING);
+    char *cq = sq;
+    if (sq != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP))
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  uring.fd, IORING_OFF_CQ_RING);
+    uring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || uring.sqes == MAP_FAILED)
+    {
+        close(uring.fd);
+        uring.fd = -1;
+        return 0;
+    }
+
+    uring.sq_head = (unsigned *)(sq + p.sq_off.head);
+    uring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    uring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    uring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    uring.cq_head = (unsigned *)(cq + p.cq_off.head);
+    uring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    uring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 1;
+}
+
+static void uring_reap(void);
+
+static long uring_syscall(unsigned to_submit, unsigned min_complete)
+{
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    long n;
+
+    while ((n = syscall(__NR_io_uring_enter, uring.fd, to_submit, min_complete, flags, NULL, 0)) < 0 &&
+           errno == EINTR)
+        ;
+    if (n < 0 && errno != EAGAIN && errno != EBUSY)
+    {
+        perror("io_uring_enter");
+        exit(1);
+    }
+    return n;
+}
+
+/*
+ * Submit everything queued and, with `min_complete',
+ * wait for that many completions. The kernel may take
+ * fewer sqes than offered (and then does not wait); the
+ * rest is offered again. EBUSY / EAGAIN mean it is out
+ * of room for completions, so some are reaped first.
+ */
+static void uring_enter(unsigned min_complete)
+{
+    for (;;)
+    {
+        long n = uring_syscall(uring.to_submit, min_complete);
+        if (n > 0)
+        {
+            uring.inflight += (unsigned)n;
+            uring.to_submit -= (unsigned)n;
+        }
+        if (n >= 0 && uring.to_submit == 0)
+            return;
+        if (n > 0)
+            continue; // partial: offer the rest
+
+        // Nothing taken: only completions can make room
+        unsigned cq_tail = atomic_load_explicit((_Atomic unsigned *)uring.cq_tail, memory_order_acquire);
+        if (cq_tail == *uring.cq_head)
+        {
+            if (!uring.inflight)
+            {
+                fprintf(stderr, "io_uring_enter: no sqe taken and nothing in flight\n");
+                exit(1);
+            }
+            uring_syscall(0, 1);
+        }
+        uring_reap();
+    }
+}
+
+static struct io_uring_sqe *uring_sqe(void)
+{
+    unsigned tail = *uring.sq_tail;
+    unsigned head = atomic_load_explicit((_Atomic unsigned *)uring.sq_head, memory_order_acquire);
+    if (tail - head > *uring.sq_mask)
+        uring_enter(0); // ring full: submit what is queued
+
+    unsigned idx = tail & *uring.sq_mask;
+    struct io_uring_sqe *sqe = &uring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    uring.sq_array[idx] = idx;
+    atomic_store_explicit((_Atomic unsigned *)uring.sq_tail, tail + 1, memory_order_release);
+    uring.to_submit++;
+    return sqe;
+}
+
+static void uring_queue_write(int b)
+{
+    struct io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = uring.buf_fd[b];
+    sqe->addr = (uint64_t)(uintptr_t)(uring.bufs[b] + uring.buf_done[b]);
+    sqe->len = (unsigned)(uring.buf_len[b] - uring.buf_done[b]);
+    sqe->off = uring.buf_off[b] + uring.buf_done[b];
+    sqe->user_data = (uint64_t)b + 1;
+}
+
+static void uring_reap(void)
+{
+    unsigned head = *uring.cq_head;
+    unsigned tail = atomic_load_explicit((_Atomic unsigned *)uring.cq_tail, memory_order_acquire);
+
+    // The head is given back per entry: a short write queued
+    // below may have to enter (and reap) again
+    for (; head != tail; head = *uring.cq_head)
+    {
+        struct io_uring_cqe cqe = uring.cqes[head & *uring.cq_mask];
+        atomic_store_explicit((_Atomic unsigned *)uring.cq_head, head + 1, memory_order_release);
+        tail = atomic_load_explicit((_Atomic unsigned *)uring.cq_tail, memory_order_acquire);
+        uring.inflight--;
+        // A write that made no progress would be resubmitted forever
+        if (cqe.res == 0 && cqe.user_data != URING_FSYNC_TAG)
+            cqe.res = -EIO;
+        if (cqe.res < 0)
+        {
+            errno = -cqe.res;
+            perror(cqe.user_data == URING_FSYNC_TAG ? "io_uring fsync" : "io_uring write");
+            if (cqe.user_data != URING_FSYNC_TAG)
+                exit(1);
+            continue;
+        }
+        if (cqe.user_data == URING_FSYNC_TAG)
+            continue;
+
+        int b = (int)cqe.user_data - 1;
+        uring.buf_done[b] += (size_t)cqe.res;
+        if (uring.buf_done[b] < uring.buf_len[b])
+            uring_queue_write(b); // short write
+        else
+            uring.busy[b] = 0;
+    }
+}
+
+static void uring_flush(struct log_writer *lw)
+{
+    int b;
+    for (;;)
+    {
+        uring_reap();
+        for (b = 0; b < URING_BUFS && uring.busy[b]; b++)
+            ;
+        if (b < URING_BUFS)
+            break;
+        uring_enter(1); // storage is behind: wait for one
+    }
+
+    memcpy(uring.bufs[b], lw->buf, lw->len);
+    uring.buf_len[b] = lw->len;
+    uring.buf_done[b] = 0;
+    uring.buf_off[b] = lw->seg_written;
+    uring.buf_fd[b] = lw->fd;
+    uring.busy[b] = 1;
+    uring_queue_write(b);
+
+    uint64_t now = monotonic_ns();
+    if (now - uring.last_fsync_ns >= URING_FSYNC_MS * 1000000ull)
+    {
+        // Drain: runs after every write queued before it
+        struct io_uring_sqe *sqe = uring_sqe();
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->flags = IOSQE_IO_DRAIN;
+        sqe->fd = lw->fd;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe->user_data = URING_FSYNC_TAG;
+        uring.last_fsync_ns = now;
+    }
+    uring_enter(0);
+}
+
+// Segment or log done: wait until everything queued for it has landed
+static void uring_close(struct log_writer *lw)
+{
+    (void)lw;
+    if (uring.to_submit)
+        uring_enter(0);
+    while (uring.inflight)
+    {
+        uring_enter(1);
+        uring_reap();
+        if (uring.to_submit)
+            uring_enter(0);
+    }
+}
+
+static const struct log_backend log_backend_uring = {
+    .name = "uring",
+    .open_flags = O_WRONLY,
+    .append = buffered_append,
+    .flush = uring_flush,
+    .close = uring_close,
+};
+#endif /* XKEY_URING */
+
+void log_writer_printf(struct log_writer *lw, const char *fmt, ...)
+{
+    char line[1024];
+    va_list ap;
+
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+
+    if (n < 0)
+        return;
+    if ((size_t)n >= sizeof(line))
+        n = sizeof(line) - 1;
+    log_writer_append(lw, line, (size_t)n);
+}
+
+/*
+ * Note that a record enqueued at `enq_ns' is now in
+ * the buffer; it is timed when the buffer is written.
+ */
+void log_writer_mark(struct log_writer *lw, uint64_t enq_ns)
+{
+    if (lw->nmarks == LOG_MARKS_MAX)
+        log_writer_flush(lw);
+    if (lw->len == 0)
+        return; // already written by the append
+    lw->marks[lw->nmarks++] = enq_ns;
+}
+
+/*
+ * Called after a FocusIn record has been appended.
+ */
+void log_writer_focus(struct log_writer *lw)
+{
+    if (lw->flush_on_focus)
+        log_writer_flush(lw);
+}
+
+// Milliseconds until the segment is seg_secs old (-1 = no age limit)
+static int log_writer_segment_left(struct log_writer *lw)
+{
+    if (!lw->seg_prefix || lw->seg_secs <= 0)
+        return -1;
+
+    uint64_t age = monotonic_ns() - lw->seg_opened_ns;
+    uint64_t limit = (uint64_t)lw->seg_secs * 1000000000ull;
+    if (age >= limit)
+        return 0;
+    uint64_t left = (limit - age + 999999) / 1000000;
+    return left > INT_MAX ? INT_MAX : (int)left;
+}
+
+/*
+ * How long the event loop may sleep before the
+ * time-based policy needs to run (-1 = forever).
+ */
+int log_writer_timeout(struct log_writer *lw)
+{
+    int timeout = log_writer_segment_left(lw);
+    if (lw->len == 0 || lw->flush_ms <= 0)
+        return timeout;
+
+    long left = lw->flush_ms - elapsed_ms(&lw->first_pending);
+    int t = left > 0 ? (int)left : 0;
+    return timeout >= 0 && timeout < t ? timeout : t;
+}
+
+static void log_writer_roll(struct log_writer *lw);
+
+void log_writer_tick(struct log_writer *lw)
+{
+    if (lw->len && lw->flush_ms > 0 && elapsed_ms(&lw->first_pending) >= lw->flush_ms)
+        log_writer_flush(lw);
+    // An idle log still rolls on time
+    if (log_writer_segment_left(lw) == 0)
+        log_writer_roll(lw);
+}
+
+/*
+ * First free segment number: one past the highest
+ * <prefix>.NNNNNN(.zst) in the current directory.
+ */
+static unsigned long log_segment_next(const char *prefix)
+{
+    size_t plen = strlen(prefix);
+    unsigned long next = 0;
+    DIR *dir = opendir(".");
+    struct dirent *de;
+
+    if (!dir)
+    {
+        perror("opendir");
+        exit(1);
+    }
+    while ((de = readdir(dir)))
+    {
+        const char *num = de->d_name + plen + 1;
+        if (strncmp(de->d_name, prefix, plen) != 0 || de->d_name[plen] != '.')
+            continue;
+        size_t ndigits = strspn(num, "0123456789");
+        if (ndigits < 6 || (num[ndigits] && strcmp(num + ndigits, ".zst") != 0))
+            continue;
+        unsigned long idx = strtoul(num, NULL, 10);
+        if (idx + 1 > next)
+            next = idx + 1;
+    }
+    closedir(dir);
+    return next;
+}
+
+static void log_writer_open_segment(struct log_writer *lw)
+{
+    snprintf(lw->seg_path, sizeof(lw->seg_path), "%s.%06lu", lw->seg_prefix, lw->seg_index);
+
+    lw->fd = open(lw->seg_path, lw->backend->open_flags | O_CREAT | O_EXCL, 0644);
+    if (lw->fd < 0)
+    {
+        perror(lw->seg_path);
+        exit(1);
+    }
+    // Best effort: not every filesystem supports it
+    if (lw->seg_size && fallocate(lw->fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)lw->seg_size) < 0 &&
+        errno != EOPNOTSUPP)
+        perror("fallocate");
+
+    lw->path = lw->seg_path;
+    lw->len = 0;
+    lw->seg_written = 0;
+    lw->seg_opened_ns = monotonic_ns();
+    if (lw->backend->open)
+        lw->backend->open(lw);
+    if (lw->segment_start)
+        lw->segment_start(lw);
+}
+
+void log_writer_open_segments(struct log_writer *lw, const char *prefix)
+{
+    lw->seg_prefix = prefix;
+    lw->seg_index = log_segment_next(prefix);
+    log_writer_open_segment(lw);
+}
+
+static void log_writer_finish_segment(struct log_writer *lw)
+{
+    log_writer_flush(lw);
+    if (lw->backend->close)
+        lw->backend->close(lw);
+    if (fsync(lw->fd) < 0)
+        perror(lw->path);
+    close(lw->fd);
+    lw->fd = -1;
+    if (lw->segment_done)
+        lw->segment_done(lw->seg_path);
+}
+
+static void log_writer_roll(struct log_writer *lw)
+{
+    log_writer_finish_segment(lw);
+    lw->seg_index++;
+    log_writer_open_segment(lw);
+    counter_add(&stats.segments, 1);
+}
+
+/*
+ * Called after each complete record: start the next
+ * segment if this one is full or old enough.
+ */
+void log_writer_record_done(struct log_writer *lw)
+{
+    if (!lw->seg_prefix)
+        return;
+
+    int full = lw->seg_size &&
+               lw->seg_written + lw->len + lw->backend->reserve >= lw->seg_size;
+    if (full || log_writer_segment_left(lw) == 0)
+        log_writer_roll(lw);
+}
+
+void log_writer_close(struct log_writer *lw)
+{
+    if (lw->seg_prefix)
+    {
+        log_writer_finish_segment(lw);
+        return;
+    }
+    log_writer_flush(lw);
+    if (lw->backend->close)
+        lw->backend->close(lw);
+    close(lw->fd);
+    lw->fd = -1;
+}
+
+#ifdef XKEY_ZSTD
+/* --------------------------------------------------
+ * Background compression of finished segments
+ * (--compress[=LEVEL], built with -DXKEY_ZSTD).
+ *
+ * Closed segments are queued to a SCHED_IDLE thread,
+ * which runs only when the CPU is otherwise idle and
+ * never holds up capture or the writer. Each segment
+ * becomes keylog.NNNNNN.zst: independent zstd frames
+ * of about ZST_FRAME_SIZE bytes, cut at entry
+ * boundaries, plus the seek table of xkeylog.h so
+ * xkey-dump can decompress only the frames of a time
+ * range. The .zst is fsynced and renamed into place
+ * before the segment is removed. Segments a previous
+ * run left uncompressed are picked up at startup.
+ * -------------------------------------------------- */
+#define ZST_FRAME_SIZE (256 * 1024)
+
+static int zst_level = 0; // 0 = compression off
+static pthread_t zst_thread;
+static pthread_mutex_t zst_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t zst_cond = PTHREAD_COND_INITIALIZER;
+static char **zst_queue = NULL;
+static size_t zst_count = 0, zst_cap = 0;
+static int zst_stop = 0;
+
+// segment_done hook of the log writer (writer thread)
+void zst_enqueue(const char *path)
+{
+    pthread_mutex_lock(&zst_lock);
+    if (zst_count == zst_cap)
+    {
+        zst_cap = zst_cap ? zst_cap * 2 : 16;
+        zst_queue = realloc(zst_queue, zst_cap * sizeof(*zst_queue));
+        if (!zst_queue)
+        {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    zst_queue[zst_count++] = strdup(path);
+    pthread_cond_signal(&zst_cond);
+    pthread_mutex_unlock(&zst_lock);
+}
+
+struct zst_out
+{
+    FILE *fp;
+    char *names; // XKEYLOG_NAME entries seen so far
+    size_t names_len, names_cap;
+    struct xkeylog_seek_entry *frames;
+    size_t nframes, frames_cap;
+};
+
+static void zst_add_names(struct zst_out *o, const char *p, size_t n)
+{
+    if (o->names_len + n > o->names_cap)
+    {
+        while (o->names_len + n > o->names_cap)
+            o->names_cap = o->names_cap ? o->names_cap * 2 : 4096;
+        o->names = realloc(o->names, o->names_cap);
+        if (!o->names)
+        {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    memcpy(o->names + o->names_len, p, n);
+    o->names_len += n;
+}
+
+/*
+ * End of the frame starting at `pos': whole entries
+ * (binary) or lines (text) up to ZST_FRAME_SIZE bytes.
+ * Fills in the frame's timestamps and collects names.
+ * For binary logs `*size' is cut at a zero type byte,
+ * the unwritten tail of an mmap segment.
+ */
+static size_t zst_frame_end(const char *data, size_t *size, size_t pos, int binary,
+                            struct xkeylog_seek_entry *fe, struct zst_out *o)
+{
+    fe->first_ts_ns = UINT64_MAX;
+    fe->last_ts_ns = 0;
+
+    if (!binary)
+    {
+        if (*size - pos <= ZST_FRAME_SIZE)
+            return *size;
+        const char *nl = memchr(data + pos + ZST_FRAME_SIZE, '\n', *size - pos - ZST_FRAME_SIZE);
+        return nl ? (size_t)(nl - data) + 1 : *size;
+    }
+
+    size_t end = pos ? pos : sizeof(struct xkeylog_header);
+    while (end < *size && end - pos < ZST_FRAME_SIZE)
+    {
+        uint8_t type = (uint8_t)data[end];
+        size_t n;
+
+        if (type == 0)
+        {
+            *size = end;
+            break;
+        }
+        if (type == XKEYLOG_NAME)
+        {
+            struct xkeylog_name ent;
+            if (end + sizeof(ent) > *size)
+                break;
+            memcpy(&ent, data + end, sizeof(ent));
+            n = sizeof(ent) + XKEYLOG_NAME_PAD(ent.len);
+            if (end + n > *size)
+                break;
+            zst_add_names(o, data + end, n);
+        }
+        else if (type == XKEYLOG_SUMMARY)
+        {
+            struct xkeylog_summary sum;
+            if (end + sizeof(sum) > *size)
+                break;
+            memcpy(&sum, data + end, sizeof(sum));
+            n = sizeof(sum) + sum.nwindows * sizeof(struct xkeylog_summary_window);
+            if (end + n > *size)
+                break;
+            if (sum.start_ts_ns < fe->first_ts_ns)
+                fe->first_ts_ns = sum.start_ts_ns;
+            if (sum.end_ts_ns > fe->last_ts_ns)
+                fe->last_ts_ns = sum.end_ts_ns;
+        }
+        else
+        {
+            struct xkeylog_record r;
+            n = sizeof(r);
+            if (end + n > *size)
+                break;
+            memcpy(&r, data + end, n);
+            if (r.ts_ns < fe->first_ts_ns)
+                fe->first_ts_ns = r.ts_ns;
+            if (r.ts_ns > fe->last_ts_ns)
+                fe->last_ts_ns = r.ts_ns;
+        }
+        end += n;
+    }
+    // A torn entry at the end goes into the last frame as is
+    if (end < *size && end - pos < ZST_FRAME_SIZE)
+        end = *size;
+    return end;
+}
+
+static int zst_write_frame(ZSTD_CCtx *cctx, struct zst_out *o, const char *src, size_t n,
+                           struct xkeylog_seek_entry *fe)
+{
+    static char obuf[64 * 1024];
+    ZSTD_inBuffer in = {src, n, 0};
+    size_t rem;
+
+    fe->c_size = 0;
+    fe->d_size = (uint32_t)n;
+    do
+    {
+        ZSTD_outBuffer out = {obuf, sizeof(obuf), 0};
+        rem = ZSTD_compressStream2(cctx, &out, &in, ZSTD_e_end);
+        if (ZSTD_isError(rem))
+        {
+            fprintf(stderr, "xkey: zstd: %s\n", ZSTD_getErrorName(rem));
+            return 0;
+        }
+        if (fwrite(obuf, 1, out.pos, o->fp) != out.pos)
+            return 0;
+        fe->c_size += (uint32_t)out.pos;
+    } while (rem);
+
+    if (o->nframes == o->frames_cap)
+    {
+        o->frames_cap = o->frames_cap ? o->frames_cap * 2 : 64;
+        o->frames = realloc(o->frames, o->frames_cap * sizeof(*o->frames));
+        if (!o->frames)
+        {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    o->frames[o->nframes++] = *fe;
+    return 1;
+}
+
+static int zst_write_seek_table(struct zst_out *o, const char *data, int binary)
+{
+    struct xkeylog_header hdr;
+    struct xkeylog_seek_footer foot = {
+        .nframes = (uint32_t)o->nframes,
+        .names_len = (uint32_t)o->names_len,
+        .binary = (uint32_t)binary,
+        .magic = XKEYLOG_SEEK_FOOTER_MAGIC,
+    };
+    uint32_t frame[2] = {
+        XKEYLOG_SEEK_MAGIC,
+        (uint32_t)(sizeof(hdr) + o->nframes * sizeof(*o->frames) + o->names_len + sizeof(foot)),
+    };
+
+    memset(&hdr, 0, sizeof(hdr));
+    if (binary)
+        memcpy(&hdr, data, sizeof(hdr));
+
+    return fwrite(frame, sizeof(frame), 1, o->fp) == 1 &&
+           fwrite(&hdr, sizeof(hdr), 1, o->fp) == 1 &&
+           fwrite(o->frames, sizeof(*o->frames), o->nframes, o->fp) == o->nframes &&
+           fwrite(o->names, 1, o->names_len, o->fp) == o->names_len &&
+           fwrite(&foot, sizeof(foot), 1, o->fp) == 1;
+}
+
+static void zst_compress_file(const char *path)
+{
+    char tmp[300], dst[300];
+    snprintf(dst, sizeof(dst), "%s.zst", path);
+    snprintf(tmp, sizeof(tmp), "%s.zst.tmp", path);
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        perror(path);
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    size_t size = (size_t)st.st_size;
+    if (size == 0)
+    {
+        close(fd);
+        return;
+    }
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        perror("mmap");
+        return;
+    }
+
+    struct zst_out o = {.fp = fopen(tmp, "wb")};
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    int binary = size >= sizeof(struct xkeylog_header) &&
+                 memcmp(data, XKEYLOG_MAGIC, sizeof(((struct xkeylog_header *)0)->magic)) == 0;
+    int ok = o.fp && cctx;
+
+    if (ok)
+    {
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, zst_level);
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+    }
+
+    size_t map_size = size;
+    for (size_t pos = 0; ok && pos < size;)
+    {
+        struct xkeylog_seek_entry fe;
+        size_t end = zst_frame_end(data, &size, pos, binary, &fe, &o);
+        ok = zst_write_frame(cctx, &o, data + pos, end - pos, &fe);
+        pos = end;
+    }
+    ok = ok && zst_write_seek_table(&o, data, binary);
+    ok = ok && fflush(o.fp) == 0 && fsync(fileno(o.fp)) == 0;
+    if (o.fp && fclose(o.fp) != 0)
+        ok = 0;
+
+    if (ok && rename(tmp, dst) == 0)
+    {
+        unlink(path);
+    }
+    else
+    {
+        fprintf(stderr, "xkey: could not compress %s\n", path);
+        unlink(tmp);
+    }
+
+    ZSTD_freeCCtx(cctx);
+    munmap(data, map_size);
+    free(o.names);
+    free(o.frames);
+}
+
+static void *zst_main(void *arg)
+{
+    (void)arg;
+    struct sched_param sp = {.sched_priority = 0};
+    if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &sp) != 0)
+        fprintf(stderr, "xkey: cannot make the compressor SCHED_IDLE\n");
+
+    for (;;)
+    {
+        pthread_mutex_lock(&zst_lock);
+        while (!zst_count && !zst_stop)
+            pthread_cond_wait(&zst_cond, &zst_lock);
+        if (!zst_count)
+        {
+            pthread_mutex_unlock(&zst_lock);
+            break;
+        }
+        char *path = zst_queue[0];
+        memmove(zst_queue, zst_queue + 1, --zst_count * sizeof(*zst_queue));
+        pthread_mutex_unlock(&zst_lock);
+
+        zst_compress_file(path);
+        free(path);
+    }
+    return NULL;
+}
+
+/*
+ * Queue <prefix>.NNNNNN segments below `first' that are
+ * still uncompressed (left over from an earlier run).
+ */
+void zst_queue_leftovers(const char *prefix, unsigned long first)
+{
+    size_t plen = strlen(prefix);
+    DIR *dir = opendir(".");
+    struct dirent *de;
+
+    while (dir && (de = readdir(dir)))
+    {
+        const char *num = de->d_name + plen + 1;
+        if (strncmp(de->d_name, prefix, plen) != 0 || de->d_name[plen] != '.' ||
+            strlen(num) < 6 || strspn(num, "0123456789") != strlen(num))
+            continue;
+        if (strtoul(num, NULL, 10) < first)
+            zst_enqueue(de->d_name);
+    }
+    if (dir)
+        closedir(dir);
+}
+
+/*
+ * Start the one compressor thread, shared by every
+ * stream.
+ */
+void zst_start(void)
+{
+    if (pthread_create(&zst_thread, NULL, zst_main, NULL) != 0)
+    {
+        fprintf(stderr, "Cannot start compressor thread\n");
+        exit(1);
+    }
+}
+
+// Compresses whatever is still queued, then returns
+void zst_finish(void)
+{
+    pthread_mutex_lock(&zst_lock);
+    zst_stop = 1;
+    pthread_cond_broadcast(&zst_cond);
+    pthread_mutex_unlock(&zst_lock);
+    pthread_join(zst_thread, NULL);
+    free(zst_queue);
+}
+#endif /* XKEY_ZSTD */
+
+/* --------------------------------------------------
+ * Arena: a bump allocator over chunks that never move,
+ * so what it hands out stays put until arena_reset()
+ * frees it all at once.
+ * -------------------------------------------------- */
+#define ARENA_CHUNK (64 * 1024)
+
+struct arena_chunk
+{
+    struct arena_chunk *next;
+    size_t used, size;
+    _Alignas(8) char data[];
+};
+
+struct arena
+{
+    struct arena_chunk *head;
+    size_t bytes; // in all chunks
+};
+
+void *arena_alloc(struct arena *a, size_t n)
+{
+    struct arena_chunk *c = a->head;
+
+    n = (n + 7) & ~(size_t)7;
+    if (!c || c->size - c->used < n)
+    {
+        size_t size = n > ARENA_CHUNK ? n : ARENA_CHUNK;
+        c = malloc(sizeof(*c) + size);
+        if (!c)
+        {
+            perror("malloc");
+            exit(1);
+        }
+        c->next = a->head;
+        c->used = 0;
+        c->size = size;
+        a->head = c;
+        a->bytes += size;
+    }
+    void *p = c->data + c->used;
+    c->used += n;
+    return p;
+}
+
+void arena_reset(struct arena *a)
+{
+    while (a->head)
+    {
+        struct arena_chunk *next = a->head->next;
+        free(a->head);
+        a->head = next;
+    }
+    a->bytes = 0;
+}
+
+/* --------------------------------------------------
+ * Window title intern table.
+ *
+ * Every distinct title is stored once, in an arena, and
+ * goes by a 32-bit id from then on: the name cache, ring
+ * records, string tables and summaries all deal in ids.
+ * The X thread interns; the writer only looks ids up.
+ * An id reaches the writer through the ring, after its
+ * string was written, and neither the strings nor the
+ * pages that map ids to them ever move, so lookups take
+ * no lock.
+ *
+ * Titles are not freed one by one. Once a generation
+ * has outgrown NAME_ARENA_MAX, names_collect() switches
+ * to the other one, re-entering only titles the name
+ * caches still hold, and sends an XREC_EPOCH marker down
+ * the ring. Records ahead of the marker keep using the
+ * old generation; only after the writer has passed it
+ * may the old one be emptied, at the next switch. So
+ * memory stays bounded however many titles come and go.
+ * The top bit of an id is its generation.
+ * -------------------------------------------------- */
+#define NAME_ARENA_MAX (4 * 1024 * 1024)
+#define NAME_PAGE_BITS 10
+#define NAME_PAGE (1u << NAME_PAGE_BITS)
+#define NAME_PAGES 1024 // titles per generation: NAME_PAGES * NAME_PAGE
+#define NAME_GEN_BIT 0x80000000u
+
+struct name_str
+{
+    uint32_t hash, len;
+    char s[]; // NUL-terminated
+};
+
+struct name_gen
+{
+    struct arena arena;
+    struct name_str **pages[NAME_PAGES]; // index -> string, allocated once
+    uint32_t count;
+    uint32_t *slots; // hash -> index + 1 (0 = empty), X thread only
+    size_t slot_cap;
+};
+
+static struct name_gen name_gens[2];
+static uint32_t names_epoch = 0; // X thread: generation names_epoch & 1
+static atomic_uint names_passed; // last XREC_EPOCH the writer is past
+
+static struct name_str *name_gen_at(const struct name_gen *g, uint32_t index)
+{
+    return g->pages[index >> NAME_PAGE_BITS][index & (NAME_PAGE - 1)];
+}
+
+static void name_gen_rehash(struct name_gen *g)
+{
+    free(g->slots);
+    g->slot_cap = g->slot_cap ? g->slot_cap * 2 : 1024;
+    g->slots = calloc(g->slot_cap, sizeof(*g->slots));
+    if (!g->slots)
+    {
+        perror("calloc");
+        exit(1);
+    }
+    for (uint32_t k = 0; k < g->count; k++)
+    {
+        size_t i = name_gen_at(g, k)->hash & (g->slot_cap - 1);
+        while (g->slots[i])
+            i = (i + 1) & (g->slot_cap - 1);
+        g->slots[i] = k + 1;
+    }
+}
+
+/*
+ * Id of the `len' bytes at `str', which are entered if
+ * they are new. XKEYLOG_NO_NAME if the generation is
+ * full. X thread only.
+ */
+uint32_t name_intern(const char *str, size_t len)
+{
+    struct name_gen *g = &name_gens[names_epoch & 1];
+    uint32_t gen = names_epoch & 1 ? NAME_GEN_BIT : 0;
+    uint32_t h = fnv1a_len(str, len);
+
+    if ((g->count + 1) * 2 > g->slot_cap)
+        name_gen_rehash(g);
+
+    size_t i = h & (g->slot_cap - 1);
+    for (; g->slots[i]; i = (i + 1) & (g->slot_cap - 1))
+    {
+        const struct name_str *e = name_gen_at(g, g->slots[i] - 1);
+        if (e->hash == h && e->len == len && memcmp(e->s, str, len) == 0)
+            return gen | (g->slots[i] - 1);
+    }
+    if (g->count == NAME_PAGES * NAME_PAGE)
+        return XKEYLOG_NO_NAME;
+
+    uint32_t index = g->count;
+    struct name_str ***page = &g->pages[index >> NAME_PAGE_BITS];
+    if (!*page && !(*page = malloc(NAME_PAGE * sizeof(**page))))
+    {
+        perror("malloc");
+        exit(1);
+    }
+    struct name_str *e = arena_alloc(&g->arena, sizeof(*e) + len + 1);
+    e->hash = h;
+    e->len = (uint32_t)len;
+    memcpy(e->s, str, len);
+    e->s[len] = '\0';
+    (*page)[index & (NAME_PAGE - 1)] = e;
+    g->slots[i] = index + 1;
+    g->count++;
+    return gen | index;
+}
+
+// The title `id' stands for, NULL for XKEYLOG_NO_NAME. Either thread.
+const char *name_str(uint32_t id)
+{
+    if (id == XKEYLOG_NO_NAME)
+        return NULL;
+    return name_gen_at(&name_gens[id & NAME_GEN_BIT ? 1 : 0], id & ~NAME_GEN_BIT)->s;
+}
+
+// Whether the X thread should move to the other generation
+static int names_full(void)
+{
+    const struct name_gen *g = &name_gens[names_epoch & 1];
+    return g->arena.bytes > NAME_ARENA_MAX || g->count > NAME_PAGES * NAME_PAGE / 2;
+}
+
+// Start generation `epoch' & 1 empty
+static void names_begin(uint32_t epoch)
+{
+    struct name_gen *g = &name_gens[epoch & 1];
+    arena_reset(&g->arena);
+    g->count = 0;
+    if (g->slots)
+        memset(g->slots, 0, g->slot_cap * sizeof(*g->slots));
+    names_epoch = epoch;
+}
+
+static unsigned long long names_bytes(void)
+{
+    return name_gens[0].arena.bytes + name_gens[1].arena.bytes;
+}
+
+void names_free(void)
+{
+    for (int k = 0; k < 2; k++)
+    {
+        arena_reset(&name_gens[k].arena);
+        for (int p = 0; p < NAME_PAGES; p++)
+            free(name_gens[k].pages[p]);
+        free(name_gens[k].slots);
+    }
+}
+
+/* --------------------------------------------------
+ * Helper function to retrieve a window's name.
+ *  - Tries _NET_WM_NAME first (UTF-8)
+ *  - Falls back to XFetchName (old WM_NAME)
+ *
+ * Returns the interned name, or XKEYLOG_NO_NAME if it
+ * has none. Whichever way it was read, the X buffer is
+ * freed here.
+ * -------------------------------------------------- */
+static uint32_t readWindowName(Display *disp, Window w)
+{
+    Atom actualType;
+    int actualFormat;
+    unsigned long nitems, bytesAfter;
+    unsigned char *prop = NULL;
+
+    // 1) Try _NET_WM_NAME
+    if (XGetWindowProperty(disp, w, atoms[ATOM__NET_WM_NAME],
+                           0, (~0L),
+                           False, AnyPropertyType,
+                           &actualType, &actualFormat,
+                           &nitems, &bytesAfter,
+                           &prop) == Success &&
+        prop)
+    {
+        // It's often UTF-8 text
+        uint32_t id = name_intern((char *)prop, strlen((char *)prop));
+        XFree(prop);
+        return id;
+    }
+
+    // 2) Fall back to XFetchName (old WM_NAME)
+    char *name_legacy = NULL;
+    if (XFetchName(disp, w, &name_legacy) && name_legacy)
+    {
+        uint32_t id = name_intern(name_legacy, strlen(name_legacy));
+        XFree(name_legacy);
+        return id;
+    }
+
+    return XKEYLOG_NO_NAME;
+}
+
+/*
+ * readWindowName(), timed for stats.name_lookup.
+ */
+uint32_t getWindowName(Display *disp, Window w)
+{
+    uint64_t t0 = monotonic_ns();
+    uint32_t name = readWindowName(disp, w);
+    hist_add(&stats.name_lookup, monotonic_ns() - t0);
+    return name;
+}
+
+/* --------------------------------------------------
+ * Window name cache.
+ *
+ * Open-addressing hash map from Window to the name id
+ * getWindowName() returned (XKEYLOG_NO_NAME for unnamed
+ * windows, so those are not refetched either). Only windows we
+ * selected PropertyChangeMask | StructureNotifyMask
+ * on may be cached: the name is refetched after a
+ * WM_NAME / _NET_WM_NAME PropertyNotify, and the entry
+ * is dropped on DestroyNotify.
+ * -------------------------------------------------- */
+static long key_release_mask = 0; // KeyReleaseMask with --timing
+
+#define SNOOP_EVENT_MASK (KeyPressMask | key_release_mask | FocusChangeMask | \
+                          PropertyChangeMask | StructureNotifyMask)
+
+// What --track adds, or selects alone on windows we only watch.
+#define TRACK_EVENT_MASK (PropertyChangeMask | StructureNotifyMask | \
+                          SubstructureNotifyMask)
+
+// Unselected windows under --watch-config: keep their names current.
+#define WATCH_EVENT_MASK (PropertyChangeMask | StructureNotifyMask)
+
+struct name_entry
+{
+    Window w; // None marks an empty slot
+    uint32_t name_id;
+    int8_t name_valid; // 0 = refetch on next use
+    int8_t wm_state;   // WM_STATE present: 1 / 0, -1 = unknown
+    Window parent;     // from ReparentNotify / CreateNotify / a lookup, None = unknown
+    Window client;     // window_client() of a frame, None = not looked up
+};
+
+static struct name_entry *name_slots = NULL;
+static size_t name_cap = 0; // power of two
+static size_t name_count = 0;
+
+static size_t name_hash(Window w)
+{
+    return (size_t)(((uint64_t)w * 0x9E3779B97F4A7C15ull) >> 32) & (name_cap - 1);
+}
+
+static struct name_entry *name_cache_find(Window w)
+{
+    if (!name_cap)
+        return NULL;
+    for (size_t i = name_hash(w);; i = (i + 1) & (name_cap - 1))
+    {
+        if (name_slots[i].w == w)
+            return &name_slots[i];
+        if (name_slots[i].w == None)
+            return NULL;
+    }
+}
+
+static void name_cache_grow(void)
+{
+    struct name_entry *old = name_slots;
+    size_t old_cap = name_cap;
+
+    name_cap = old_cap ? old_cap * 2 : 256;
+    name_slots = calloc(name_cap, sizeof(*name_slots));
+    if (!name_slots)
+    {
+        perror("calloc");
+        exit(1);
+    }
+
+    for (size_t k = 0; k < old_cap; k++)
+    {
+        if (old[k].w == None)
+            continue;
+        size_t i = name_hash(old[k].w);
+        while (name_slots[i].w != None)
+            i = (i + 1) & (name_cap - 1);
+        name_slots[i] = old[k];
+    }
+    free(old);
+}
+
+/*
+ * Find or insert the entry for `w'.
+ */
+static struct name_entry *name_cache_entry(Window w)
+{
+    struct name_entry *e = name_cache_find(w);
+    if (e)
+        return e;
+
+    if ((name_count + 1) * 4 > name_cap * 3)
+        name_cache_grow();
+
+    size_t i = name_hash(w);
+    while (name_slots[i].w != None)
+        i = (i + 1) & (name_cap - 1);
+    name_slots[i].w = w;
+    name_slots[i].name_id = XKEYLOG_NO_NAME;
+    name_slots[i].name_valid = 0;
+    name_slots[i].wm_state = -1;
+    name_slots[i].parent = None;
+    name_slots[i].client = None;
+    name_count++;
+    return &name_slots[i];
+}
+
+void name_cache_put(Window w, uint32_t name_id)
+{
+    struct name_entry *e = name_cache_entry(w);
+    e->name_id = name_id;
+    e->name_valid = 1;
+}
+
+/*
+ * The window's title changed: refetch it on next use.
+ */
+void name_cache_invalidate(Window w)
+{
+    struct name_entry *e = name_cache_find(w);
+    if (e)
+        e->name_valid = 0;
+}
+
+/*
+ * Drop the entry for `w' (backward-shift deletion,
+ * so lookups never need tombstones).
+ */
+void name_cache_forget(Window w)
+{
+    struct name_entry *e = name_cache_find(w);
+    if (!e)
+        return;
+
+    name_count--;
+
+    size_t hole = (size_t)(e - name_slots);
+    for (size_t i = (hole + 1) & (name_cap - 1); name_slots[i].w != None;
+         i = (i + 1) & (name_cap - 1))
+    {
+        size_t home = name_hash(name_slots[i].w);
+        // Move the entry back if its home is not in (hole, i]
+        if (((i - home) & (name_cap - 1)) >= ((i - hole) & (name_cap - 1)))
+        {
+            name_slots[hole] = name_slots[i];
+            hole = i;
+        }
+    }
+    name_slots[hole].w = None;
+}
+
+/*
+ * Cached getWindowName().
+ */
+uint32_t name_cache_get_id(Window w)
+{
+    struct name_entry *e = name_cache_find(w);
+    if (e && e->name_valid)
+    {
+        counter_add(&stats.name_hits, 1);
+        return e->name_id;
+    }
+
+    counter_add(&stats.name_misses, 1);
+    uint32_t name_id = getWindowName(d, w);
+    name_cache_put(w, name_id);
+    return name_id;
+}
+
+/*
+ * The same as a string, valid until the next
+ * names_collect().
+ */
+const char *name_cache_get(Window w)
+{
+    return name_str(name_cache_get_id(w));
+}
+
+/*
+ * Move every name still cached to the current intern
+ * generation (names_collect()). Names that are due to
+ * be refetched anyway are dropped.
+ */
+void name_cache_renew(void)
+{
+    for (size_t i = 0; i < name_cap; i++)
+    {
+        struct name_entry *e = &name_slots[i];
+        if (e->w == None || e->name_id == XKEYLOG_NO_NAME)
+            continue;
+        if (e->name_valid)
+        {
+            const char *name = name_str(e->name_id);
+            e->name_id = name_intern(name, strlen(name));
+        }
+        else
+        {
+            e->name_id = XKEYLOG_NO_NAME;
+        }
+    }
+}
+
+static int read_wm_state(Window w)
+{
+    Atom type = None;
+    int format;
+    unsigned long nitems, after;
+    unsigned char *prop = NULL;
+
+    if (XGetWindowProperty(d, w, atoms[ATOM_WM_STATE], 0, 0, False, AnyPropertyType,
+                           &type, &format, &nitems, &after, &prop) != Success)
+        type = None;
+    if (prop)
+        XFree(prop);
+    return type != None;
+}
+
+/*
+ * Whether `w' is a client window (has WM_STATE) rather
+ * than a WM frame or container. Cached like the name.
+ */
+int window_is_client(Window w)
+{
+    struct name_entry *e = name_cache_entry(w);
+    if (e->wm_state < 0)
+        e->wm_state = read_wm_state(w);
+    return e->wm_state;
+}
+
+/*
+ * Add WATCH_EVENT_MASK to what we select on `w', for a
+ * window that gets a cache entry without having been
+ * selected by the scan.
+ */
+static void window_watch(Window w)
+{
+    XWindowAttributes wa;
+    if (XGetWindowAttributes(d, w, &wa) && (wa.your_event_mask & WATCH_EVENT_MASK) != WATCH_EVENT_MASK)
+        XSelectInput(d, w, wa.your_event_mask | WATCH_EVENT_MASK);
+}
+
+/* --------------------------------------------------
+ * Frame -> client resolution.
+ *
+ * With a reparenting WM, FocusIn often lands on a frame
+ * or container around the client. The client (the
+ * window with WM_STATE) is looked up below the frame
+ * once and kept in the frame's cache entry. Parents are
+ * kept from ReparentNotify and CreateNotify, and
+ * DestroyNotify drops entries, so a cached client is
+ * checked to still sit under its frame with the cache
+ * alone, no requests.
+ * -------------------------------------------------- */
+#define CLIENT_DEPTH 4 // most levels between a frame and its client
+
+/*
+ * Forget "no client below" for `w' and its ancestors,
+ * after something under them changed.
+ */
+static void window_client_reset(Window w)
+{
+    for (int i = 0; i < CLIENT_DEPTH && w != None; i++)
+    {
+        struct name_entry *e = name_cache_find(w);
+        if (!e)
+            return;
+        if (e->client == w)
+            e->client = None;
+        w = e->parent;
+    }
+}
+
+void window_set_parent(Window w, Window parent)
+{
+    name_cache_entry(w)->parent = parent;
+    window_client_reset(parent);
+}
+
+// Whether `c' is still at most CLIENT_DEPTH levels under `w'
+static int client_under(Window c, Window w)
+{
+    for (int i = 0; i < CLIENT_DEPTH && c != None; i++)
+    {
+        struct name_entry *e = name_cache_find(c);
+        if (!e)
+            return 0;
+        if (e->parent == w)
+            return 1;
+        c = e->parent;
+    }
+    return 0;
+}
+
+/*
+ * Children first, then their subtrees. Only the windows
+ * on the path down to the client get cache entries (for
+ * their parents), and those are watched.
+ */
+static Window find_client_below(Window w, int depth)
+{
+    Window root, parent, *children = NULL, found = None, via = None;
+    unsigned int n;
+
+    if (depth == 0 || !XQueryTree(d, w, &root, &parent, &children, &n))
+        return None;
+    for (unsigned int i = 0; i < n && found == None; i++)
+    {
+        if (read_wm_state(children[i]))
+            found = via = children[i];
+    }
+    for (unsigned int i = 0; i < n && found == None; i++)
+    {
+        found = find_client_below(children[i], depth - 1);
+        if (found != None)
+            via = children[i];
+    }
+    if (children)
+        XFree(children);
+
+    if (via != None)
+    {
+        window_watch(via);
+        name_cache_entry(via)->parent = w;
+    }
+    return found;
+}
+
+/*
+ * The client window `w' stands for: itself if it has
+ * WM_STATE (or nothing below it does), else the client
+ * it frames.
+ *
+ * The frame, the client and the windows between them
+ * are cached from here on, so on a lookup they are
+ * also selected for WATCH_EVENT_MASK (on top of what
+ * they had): cached names must see their renames and
+ * cached entries their DestroyNotify.
+ */
+Window window_client(Window w)
+{
+    if (w == None || w == DefaultRootWindow(d) || window_is_client(w))
+        return w;
+
+    struct name_entry *e = name_cache_find(w);
+    if (e->client == w || (e->client != None && client_under(e->client, w)))
+        return e->client;
+
+    window_watch(w);
+    Window c = find_client_below(w, CLIENT_DEPTH);
+    if (c == None)
+        c = w;
+    else
+        name_cache_entry(c)->wm_state = 1;
+    name_cache_entry(w)->client = c;
+    return c;
+}
+
+void name_cache_clear(void)
+{
+    free(name_slots);
+    name_slots = NULL;
+    name_cap = name_count = 0;
+}
+
+/* --------------------------------------------------
+ * Designated window patterns.
+ *
+ * config.txt holds one pattern per line; empty lines
+ * and lines starting with '#' are skipped. A pattern
+ * matches anywhere in a window name, at its start with
+ * a leading '^', at its end with a trailing '$', so
+ * "^name$" is an exact match.
+ *
+ * All patterns are compiled into one Aho-Corasick
+ * automaton with a full 256-way transition table, so a
+ * name is matched in a single pass over its bytes no
+ * matter how many patterns there are.
+ * -------------------------------------------------- */
+#define PAT_ANCHOR_START 1
+#define PAT_ANCHOR_END 2
+
+struct pattern
+{
+    uint32_t len;
+    uint8_t flags;
+    int32_t next; // next pattern ending in the same state, -1 = none
+};
+
+struct ac_state
+{
+    uint32_t next[256]; // 0 (the root) doubles as "no child" while building
+    uint32_t fail;
+    uint32_t dict; // nearest state on the fail chain with patterns, 0 = none
+    int32_t out;   // first pattern ending here, -1 = none
+    uint8_t any;   // an unanchored pattern ends here or on the fail chain
+};
+
+struct matcher
+{
+    struct ac_state *states;
+    size_t nstates, states_cap;
+    struct pattern *pats;
+    size_t npats, pats_cap;
+};
+
+static uint32_t matcher_new_state(struct matcher *m)
+{
+    if (m->nstates == m->states_cap)
+    {
+        m->states_cap = m->states_cap ? m->states_cap * 2 : 64;
+        m->states = realloc(m->states, m->states_cap * sizeof(*m->states));
+        if (!m->states)
+        {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    struct ac_state *st = &m->states[m->nstates];
+    memset(st, 0, sizeof(*st));
+    st->out = -1;
+    return (uint32_t)m->nstates++;
+}
+
+struct matcher *matcher_new(void)
+{
+    struct matcher *m = calloc(1, sizeof(*m));
+    if (!m)
+    {
+        perror("calloc");
+        exit(1);
+    }
+    matcher_new_state(m); // root
+    return m;
+}
+
+void matcher_add(struct matcher *m, const char *pat, size_t len)
+{
+    uint8_t flags = 0;
+    if (len && pat[0] == '^')
+    {
+        flags |= PAT_ANCHOR_START;
+        pat++;
+        len--;
+    }
+    if (len && pat[len - 1] == '$')
+    {
+        flags |= PAT_ANCHOR_END;
+        len--;
+    }
+    if (!len)
+        return;
+
+    uint32_t s = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        unsigned char c = (unsigned char)pat[i];
+        if (!m->states[s].next[c])
+        {
+            uint32_t t = matcher_new_state(m);
+            m->states[s].next[c] = t;
+        }
+        s = m->states[s].next[c];
+    }
+
+    if (m->npats == m->pats_cap)
+    {
+        m->pats_cap = m->pats_cap ? m->pats_cap * 2 : 16;
+        m->pats = realloc(m->pats, m->pats_cap * sizeof(*m->pats));
+        if (!m->pats)
+        {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    struct pattern *p = &m->pats[m->npats];
+    p->len = (uint32_t)len;
+    p->flags = flags;
+    p->next = m->states[s].out;
+    m->states[s].out = (int32_t)m->npats++;
+    if (!flags)
+        m->states[s].any = 1;
+}
+
+/*
+ * Fill in fail links and turn the trie into a DFA.
+ * States are created parent before child, so a BFS
+ * order is just a queue over state numbers.
+ */
+void matcher_build(struct matcher *m)
+{
+    uint32_t *queue = malloc(m->nstates * sizeof(*queue));
+    size_t qhead = 0, qtail = 0;
+    if (!queue)
+    {
+        perror("malloc");
+        exit(1);
+    }
+
+    struct ac_state *root = &m->states[0];
+    for (int c = 0; c < 256; c++)
+    {
+        uint32_t t = root->next[c];
+        if (t)
+        {
+            m->states[t].fail = 0;
+            m->states[t].dict = 0;
+            queue[qtail++] = t;
+        }
+    }
+
+    while (qhead < qtail)
+    {
+        uint32_t s = queue[qhead++];
+        struct ac_state *st = &m->states[s];
+        for (int c = 0; c < 256; c++)
+        {
+            uint32_t t = st->next[c];
+            uint32_t f = m->states[st->fail].next[c];
+            if (!t)
+            {
+                st->next[c] = f;
+                continue;
+            }
+            struct ac_state *tt = &m->states[t];
+            tt->fail = f;
+            tt->dict = m->states[f].out >= 0 ? f : m->states[f].dict;
+            tt->any |= m->states[f].any;
+            queue[qtail++] = t;
+        }
+    }
+    free(queue);
+}
+
+void matcher_free(struct matcher *m)
+{
+    if (!m)
+        return;
+    free(m->states);
+    free(m->pats);
+    free(m);
+}
+
+/*
+ * Returns 1 if any pattern matches `wname'. An empty
+ * matcher never matches.
+ */
+int matcher_match(const struct matcher *m, const char *wname)
+{
+    uint32_t s = 0;
+
+    for (size_t i = 0; wname[i]; i++)
+    {
+        s = m->states[s].next[(unsigned char)wname[i]];
+        if (m->states[s].any)
+            return 1;
+
+        // Anchored patterns ending at `i'
+        for (uint32_t t = s; t; t = m->states[t].dict)
+        {
+            for (int32_t k = m->states[t].out; k >= 0; k = m->pats[k].next)
+            {
+                const struct pattern *p = &m->pats[k];
+                if ((p->flags & PAT_ANCHOR_START) && p->len != i + 1)
+                    continue;
+                if ((p->flags & PAT_ANCHOR_END) && wname[i + 1] != '\0')
+                    continue;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Read the patterns in `path'. Returns NULL (capture
+ * everything) if the file is missing or has none.
+ */
+struct matcher *config_load(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return NULL;
+
+    struct matcher *m = matcher_new();
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t n;
+
+    while ((n = getline(&line, &line_cap, fp)) != -1)
+    {
+        while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r'))
+            line[--n] = '\0';
+        if (n == 0 || line[0] == '#')
+            continue;
+        matcher_add(m, line, (size_t)n);
+    }
+    if (ferror(fp))
+    {
+        perror(path);
+        exit(1);
+    }
+    free(line);
+    fclose(fp);
+
+    if (!m->npats)
+    {
+        matcher_free(m);
+        return NULL;
+    }
+    matcher_build(m);
+    return m;
+}
+
+/* --------------------------------------------------
+ * We’ll use this function to decide if a window name
+ * matches any of the designated patterns.
+ * -------------------------------------------------- */
+int nameMatchesDesignated(const char *wname, const struct matcher *designated)
+{
+    if (!wname || !*wname)
+        return 0;
+    if (!designated)
+        return 0;
+
+    return matcher_match(designated, wname);
+}
+
+/* --------------------------------------------------
+ * We'll store *all* windows that match the designated
+ * patterns in a hash set (open addressing, like the
+ * name cache).
+ * -------------------------------------------------- */
+struct window_set
+{
+    Window *slots; // None marks an empty slot
+    size_t cap;    // power of two
+    size_t count;
+};
+
+static struct window_set matched;
+
+static size_t window_set_hash(const struct window_set *set, Window w)
+{
+    return (size_t)(((uint64_t)w * 0x9E3779B97F4A7C15ull) >> 32) & (set->cap - 1);
+}
+
+static Window *window_set_slot(const struct window_set *set, Window w)
+{
+    if (!set->cap)
+        return NULL;
+    for (size_t i = window_set_hash(set, w);; i = (i + 1) & (set->cap - 1))
+    {
+        if (set->slots[i] == w)
+            return &set->slots[i];
+        if (set->slots[i] == None)
+            return NULL;
+    }
+}
+
+int window_set_has(const struct window_set *set, Window w)
+{
+    return window_set_slot(set, w) != NULL;
+}
+
+static void window_set_insert(struct window_set *set, Window w)
+{
+    size_t i = window_set_hash(set, w);
+    while (set->slots[i] != None)
+        i = (i + 1) & (set->cap - 1);
+    set->slots[i] = w;
+    set->count++;
+}
+
+void window_set_add(struct window_set *set, Window w)
+{
+    if (window_set_has(set, w))
+        return;
+
+    if ((set->count + 1) * 4 > set->cap * 3)
+    {
+        Window *old = set->slots;
+        size_t old_cap = set->cap;
+
+        set->cap = old_cap ? old_cap * 2 : 64;
+        set->slots = calloc(set->cap, sizeof(*set->slots));
+        if (!set->slots)
+        {
+            perror("calloc");
+            exit(1);
+        }
+        set->count = 0;
+        for (size_t k = 0; k < old_cap; k++)
+            if (old[k] != None)
+                window_set_insert(set, old[k]);
+        free(old);
+    }
+    window_set_insert(set, w);
+}
+
+void window_set_remove(struct window_set *set, Window w)
+{
+    Window *slot = window_set_slot(set, w);
+    if (!slot)
+        return;
+    set->count--;
+
+    size_t hole = (size_t)(slot - set->slots);
+    for (size_t i = (hole + 1) & (set->cap - 1); set->slots[i] != None;
+         i = (i + 1) & (set->cap - 1))
+    {
+        size_t home = window_set_hash(set, set->slots[i]);
+        // Move the entry back if its home is not in (hole, i]
+        if (((i - home) & (set->cap - 1)) >= ((i - hole) & (set->cap - 1)))
+        {
+            set->slots[hole] = set->slots[i];
+            hole = i;
+        }
+    }
+    set->slots[hole] = None;
+}
+
+void window_set_clear(struct window_set *set)
+{
+    free(set->slots);
+    set->slots = NULL;
+    set->cap = set->count = 0;
+}
+
+/* --------------------------------------------------
+ * Window tree scan.
+ *
+ * scan_below() visits every descendant of the `tops'
+ * (not the tops themselves) once, passing the window's
+ * name when `want_names' is set (XKEYLOG_NO_NAME if it
+ * has none, or names were not wanted), already
+ * interned. scan_tree() does so below the root.
+ *
+ * With XKEY_XCB the tree is walked breadth-first and
+ * every query_tree / get_property for one level is
+ * sent before any reply is read, so a scan costs one
+ * round trip per tree level rather than several per
+ * window. Otherwise the serialized Xlib walk is used.
+ * -------------------------------------------------- */
+typedef void (*scan_visit_fn)(Window w, uint32_t name_id);
+
+#ifdef XKEY_XCB
+
+// The string property of the reply, interned unless `skip'
+static uint32_t xcb_property_name(xcb_connection_t *c, xcb_get_property_cookie_t ck, int skip)
+{
+    xcb_generic_error_t *err = NULL;
+    xcb_get_property_reply_t *r = xcb_get_property_reply(c, ck, &err);
+    uint32_t id = XKEYLOG_NO_NAME;
+
+    if (r && r->format == 8 && !skip)
+    {
+        int len = xcb_get_property_value_length(r);
+        if (len > 0)
+            id = name_intern(xcb_get_property_value(r), (size_t)len);
+    }
+    free(r);
+    free(err);
+    return id;
+}
+
+// Names of `n' windows: every request first, then the replies
+static void fetch_names(const Window *ws, size_t n, scan_visit_fn visit)
+{
+    xcb_connection_t *c = XGetXCBConnection(d);
+    xcb_get_property_cookie_t *nc = malloc((n + 1) * sizeof(*nc));
+    xcb_get_property_cookie_t *lc = malloc((n + 1) * sizeof(*lc));
+
+    XFlush(d);
+    for (size_t i = 0; i < n; i++)
+    {
+        nc[i] = xcb_get_property(c, 0, (xcb_window_t)ws[i], (xcb_atom_t)atoms[ATOM__NET_WM_NAME],
+                                 XCB_GET_PROPERTY_TYPE_ANY, 0, UINT32_MAX);
+        lc[i] = xcb_get_property(c, 0, (xcb_window_t)ws[i], XCB_ATOM_WM_NAME,
+                                 XCB_ATOM_STRING, 0, UINT32_MAX);
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        uint32_t name = xcb_property_name(c, nc[i], 0);
+        uint32_t legacy = xcb_property_name(c, lc[i], name != XKEYLOG_NO_NAME);
+        visit(ws[i], name != XKEYLOG_NO_NAME ? name : legacy);
+    }
+    free(nc);
+    free(lc);
+}
+
+static void scan_below(const Window *tops, size_t ntops, int want_names, scan_visit_fn visit)
+{
+    xcb_connection_t *c = XGetXCBConnection(d);
+
+    size_t level_n = ntops, next_n = 0, next_cap = 64;
+    xcb_window_t *level = malloc((ntops + 1) * sizeof(*level));
+    xcb_window_t *next = malloc(next_cap * sizeof(*next));
+    for (size_t i = 0; i < ntops; i++)
+        level[i] = (xcb_window_t)tops[i];
+
+    // Make sure everything Xlib queued so far goes out first.
+    XFlush(d);
+
+    for (int depth = 0; level_n > 0; depth++)
+    {
+        xcb_query_tree_cookie_t *qc = malloc(level_n * sizeof(*qc));
+        xcb_get_property_cookie_t *nc = NULL, *lc = NULL;
+        int names = want_names && depth > 0;
+
+        // 1) Send every request for this level...
+        for (size_t i = 0; i < level_n; i++)
+            qc[i] = xcb_query_tree(c, level[i]);
+        if (names)
+        {
+            nc = malloc(level_n * sizeof(*nc));
+            lc = malloc(level_n * sizeof(*lc));
+            for (size_t i = 0; i < level_n; i++)
+            {
+                nc[i] = xcb_get_property(c, 0, level[i],
+                                         (xcb_atom_t)atoms[ATOM__NET_WM_NAME],
+                                         XCB_GET_PROPERTY_TYPE_ANY, 0, UINT32_MAX);
+                lc[i] = xcb_get_property(c, 0, level[i], XCB_ATOM_WM_NAME,
+                                         XCB_ATOM_STRING, 0, UINT32_MAX);
+            }
+        }
+
+        // 2) ...then collect the replies.
+        next_n = 0;
+        for (size_t i = 0; i < level_n; i++)
+        {
+            if (names)
+            {
+                uint32_t name = xcb_property_name(c, nc[i], 0);
+                uint32_t legacy = xcb_property_name(c, lc[i], name != XKEYLOG_NO_NAME);
+                visit(level[i], name != XKEYLOG_NO_NAME ? name : legacy);
+            }
+            else if (depth > 0)
+            {
+                visit(level[i], XKEYLOG_NO_NAME);
+            }
+
+            xcb_generic_error_t *err = NULL;
+            xcb_query_tree_reply_t *r = xcb_query_tree_reply(c, qc[i], &err);
+            free(err);
+            if (!r)
+                continue;
+
+            int nch = xcb_query_tree_children_length(r);
+            xcb_window_t *ch = xcb_query_tree_children(r);
+            if (next_n + (size_t)nch > next_cap)
+            {
+                while (next_n + (size_t)nch > next_cap)
+                    next_cap *= 2;
+                xcb_window_t *grown = realloc(next, next_cap * sizeof(*next));
+                if (!grown)
+                {
+                    perror("realloc");
+                    exit(1);
+                }
+                next = grown;
+            }
+            memcpy(next + next_n, ch, (size_t)nch * sizeof(*ch));
+            next_n += (size_t)nch;
+            free(r);
+        }
+        free(qc);
+        free(nc);
+        free(lc);
+
+        // Descend one level
+        xcb_window_t *tmp = level;
+        level = next;
+        level_n = next_n;
+        if (level_n > 0)
+        {
+            next_cap = level_n;
+            next = realloc(tmp, next_cap * sizeof(*next));
+            if (!next)
+            {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        else
+        {
+            next = tmp;
+        }
+    }
+
+    free(level);
+    free(next);
+}
+
+#else
+
+// Plain Xlib has no way to pipeline these; one round trip each
+static void fetch_names(const Window *ws, size_t n, scan_visit_fn visit)
+{
+    for (size_t i = 0; i < n; i++)
+        visit(ws[i], getWindowName(d, ws[i]));
+}
+
+static void scan_below(const Window *tops, size_t ntops, int want_names, scan_visit_fn visit)
+{
+    for (size_t t = 0; t < ntops; t++)
+    {
+        Window root, parent, *children;
+        unsigned int nchildren;
+        if (!XQueryTree(d, tops[t], &root, &parent, &children, &nchildren) || nchildren == 0)
+        {
+            continue;
+        }
+
+        for (unsigned int i = 0; i < nchildren; i++)
+        {
+            // For each child, attempt to get the window name
+            visit(children[i], want_names ? getWindowName(d, children[i]) : XKEYLOG_NO_NAME);
+
+            // Recursively look for deeper children
+            scan_below(&children[i], 1, want_names, visit);
+        }
+
+        XFree(children);
+    }
+}
+
+#endif /* XKEY_XCB */
+
+void scan_tree(Window root, int want_names, scan_visit_fn visit)
+{
+    scan_below(&root, 1, want_names, visit);
+}
+
+/*
+ * Window-valued property `prop' of `w', or NULL (an
+ * XFree()able array of `*n' windows).
+ */
+static Window *read_window_list(Window w, Atom prop, unsigned long *n)
+{
+    Atom type = None;
+    int format;
+    unsigned long after;
+    unsigned char *data = NULL;
+
+    *n = 0;
+    if (XGetWindowProperty(d, w, prop, 0, (~0L), False, XA_WINDOW, &type, &format, n,
+                           &after, &data) != Success)
+        return NULL;
+    if (type != XA_WINDOW || format != 32 || *n == 0)
+    {
+        if (data)
+            XFree(data);
+        *n = 0;
+        return NULL;
+    }
+    return (Window *)data;
+}
+
+/*
+ * Startup on an EWMH window manager: visit the clients
+ * in _NET_CLIENT_LIST, with their names fetched in one
+ * batch, and then their subwindows (which may select
+ * KeyPress themselves), whose names are never matched.
+ * The frames and other WM windows are left out. Returns
+ * 0 (having visited nothing) if there is no client list.
+ */
+int scan_clients(Window root, int want_names, scan_visit_fn visit)
+{
+    unsigned long n;
+    Window *clients = read_window_list(root, atoms[ATOM__NET_CLIENT_LIST], &n);
+    if (!clients)
+        return 0;
+
+    if (want_names)
+        fetch_names(clients, n, visit);
+    else
+        for (unsigned long i = 0; i < n; i++)
+            visit(clients[i], XKEYLOG_NO_NAME);
+    scan_below(clients, n, 0, visit);
+    XFree(clients);
+    return 1;
+}
+
+/*
+ * Collected by snoop_visit() during the scan, so the
+ * tree is walked only once for both modes below.
+ */
+struct scanned_window
+{
+    Window w;
+    uint32_t name_id;
+};
+
+static struct scanned_window *scanned = NULL;
+static size_t scanned_count = 0, scanned_cap = 0;
+
+static void snoop_visit(Window w, uint32_t name_id)
+{
+    if (scanned_count == scanned_cap)
+    {
+        scanned_cap = scanned_cap ? scanned_cap * 2 : 256;
+        struct scanned_window *grown = realloc(scanned, scanned_cap * sizeof(*scanned));
+        if (!grown)
+        {
+            perror("realloc");
+            exit(1);
+        }
+        scanned = grown;
+    }
+    scanned[scanned_count].w = w;
+    scanned[scanned_count].name_id = name_id;
+    scanned_count++;
+}
+
+/* --------------------------------------------------
+ * We want to do one pass:
+ *   - find all windows matching designated name
+ *   - If found => only select KeyPressMask/FocusChangeMask on them
+ *   - If none found => select KeyPressMask/FocusChangeMask on *all* windows
+ *
+ * With `track' set, every window (and the root) also
+ * gets SubstructureNotifyMask so windows created later
+ * are picked up by track_new_window() below, and in
+ * the designated case unmatched windows are still
+ * watched for name changes. With `watch_config' this
+ * is done too (without SubstructureNotifyMask), and
+ * every window is kept in the name cache, so a config
+ * reload can reselect without walking the tree again.
+ *
+ * The windows come from _NET_CLIENT_LIST and the
+ * clients' subtrees when the WM keeps one, else (or
+ * with `full_scan') from walking the whole tree. Only
+ * the clients' own names are read, and a nameless
+ * subwindow is captured exactly when the full walk
+ * would capture it.
+ * -------------------------------------------------- */
+void focus_intake(Window w);
+
+static int full_scan = 0;
+static int track_windows = 0;
+static int watch_config = 0;
+static int track_matched_only = 0;
+static const struct matcher *track_designated = NULL;
+
+// What windows that are watched but not captured get
+static long unselected_mask(void)
+{
+    return track_windows ? TRACK_EVENT_MASK : WATCH_EVENT_MASK;
+}
+
+void snoop_windows(const struct matcher *designated, int *foundAnyMatches)
+{
+    Window root = DefaultRootWindow(d);
+    long extra = track_windows ? SubstructureNotifyMask : 0;
+
+    // Before the scan, so nothing created during it is missed
+    if (track_windows)
+        XSelectInput(d, root, SubstructureNotifyMask);
+
+    // 1) Gather all windows (with names if we have anything to match)
+    int want_names = designated != NULL || watch_config;
+    if (full_scan || !scan_clients(root, want_names, snoop_visit))
+        scan_tree(root, want_names, snoop_visit);
+
+    for (size_t i = 0; i < scanned_count; i++)
+    {
+        if (nameMatchesDesignated(name_str(scanned[i].name_id), designated))
+            window_set_add(&matched, scanned[i].w);
+    }
+
+    // 2) Select on the matched windows, or on all of them if none
+    //    matched (like the original code). Windows that get
+    //    PropertyChangeMask can have their scanned name cached.
+    *foundAnyMatches = matched.count > 0;
+    track_matched_only = *foundAnyMatches;
+    track_designated = designated;
+
+    for (size_t i = 0; i < scanned_count; i++)
+    {
+        struct scanned_window *sw = &scanned[i];
+        int selected = !*foundAnyMatches || window_set_has(&matched, sw->w);
+
+        if (selected || track_windows || watch_config)
+        {
+            XSelectInput(d, sw->w, selected ? SNOOP_EVENT_MASK | extra : unselected_mask());
+            if (sw->name_id != XKEYLOG_NO_NAME || watch_config)
+                name_cache_put(sw->w, sw->name_id);
+        }
+    }
+
+    free(scanned);
+    scanned = NULL;
+    scanned_count = scanned_cap = 0;
+
+    // Log the window that already has focus
+    unsigned long n;
+    Window *active = read_window_list(root, atoms[ATOM__NET_ACTIVE_WINDOW], &n);
+    if (active)
+    {
+        if (active[0] != None && (!*foundAnyMatches || window_set_has(&matched, active[0])))
+            focus_intake(active[0]);
+        XFree(active);
+    }
+}
+
+/* --------------------------------------------------
+ * Incremental tracking (--track).
+ *
+ * The catch-all / designated decision made by the
+ * startup scan is kept; these only apply it to windows
+ * as they come and go, with O(1) requests per window.
+ * -------------------------------------------------- */
+
+/*
+ * CreateNotify / ReparentNotify: start watching `w'.
+ * In designated mode the name is usually not set yet,
+ * so matching waits for MapNotify or a name change.
+ */
+void track_new_window(Window w)
+{
+    if (!track_windows)
+        return;
+
+    if (!track_matched_only || window_set_has(&matched, w))
+        XSelectInput(d, w, SNOOP_EVENT_MASK | SubstructureNotifyMask);
+    else
+        XSelectInput(d, w, unselected_mask());
+}
+
+/*
+ * MapNotify / name change: (re)match `w' against the
+ * designated name and update its selection.
+ */
+void track_check_window(Window w)
+{
+    if (!(track_windows || watch_config) || !track_matched_only)
+        return;
+
+    int matches = nameMatchesDesignated(name_cache_get(w), track_designated);
+    int was_matched = window_set_has(&matched, w);
+
+    if (matches && !was_matched)
+    {
+        window_set_add(&matched, w);
+        XSelectInput(d, w, SNOOP_EVENT_MASK | (track_windows ? SubstructureNotifyMask : 0));
+    }
+    else if (!matches && was_matched)
+    {
+        window_set_remove(&matched, w);
+        XSelectInput(d, w, unselected_mask());
+    }
+}
+
+void track_forget_window(Window w)
+{
+    name_cache_forget(w);
+    window_set_remove(&matched, w);
+}
+
+/*
+ * Redo the catch-all / designated decision with a new
+ * pattern set over the windows in the name cache, and
+ * change the selection only of windows whose status
+ * changed. Needs `watch_config' so the cache holds
+ * every window the scan found.
+ */
+void reselect_windows(const struct matcher *designated)
+{
+    struct window_set next = {0};
+
+    for (size_t i = 0; i < name_cap; i++)
+    {
+        Window w = name_slots[i].w;
+        if (w != None && nameMatchesDesignated(name_cache_get(w), designated))
+            window_set_add(&next, w);
+    }
+
+    int was_all = !track_matched_only, now_all = next.count == 0;
+    long extra = track_windows ? SubstructureNotifyMask : 0;
+    unsigned long changed = 0;
+
+    for (size_t i = 0; i < name_cap; i++)
+    {
+        Window w = name_slots[i].w;
+        if (w == None)
+            continue;
+
+        int was = was_all || window_set_has(&matched, w);
+        int now = now_all || window_set_has(&next, w);
+        if (was != now)
+        {
+            XSelectInput(d, w, now ? SNOOP_EVENT_MASK | extra : unselected_mask());
+            changed++;
+        }
+    }
+
+    window_set_clear(&matched);
+    matched = next;
+    track_matched_only = !now_all;
+    track_designated = designated;
+    fprintf(stderr, "xkey: %s, %zu windows matched, %lu reselected\n",
+            now_all ? "capturing all windows" : "capturing designated windows",
+            matched.count, changed);
+}
+
+/*
+ * Windows can disappear between an event naming them
+ * and our request on them; that is expected while
+ * tracking, so BadWindow is not fatal.
+ */
+static int handle_x_error(Display *disp, XErrorEvent *err)
+{
+    if (err->error_code == BadWindow)
+        return 0;
+
+    char msg[256];
+    XGetErrorText(disp, err->error_code, msg, sizeof(msg));
+    fprintf(stderr, "X error: %s (request %d)\n", msg, err->request_code);
+    return 0;
+}
+
+/* --------------------------------------------------
+ * Translate a KeyPress event into a readable string.
+ * -------------------------------------------------- */
+#define KEY_BUFF_SIZE 256
+static char key_buff[KEY_BUFF_SIZE];
+
+char *TranslateKeyCode(XEvent *ev, KeySym *keysym)
+{
+    KeySym ks = NoSymbol;
+    XKeyEvent *xk = (XKeyEvent *)ev;
+    int count = XLookupString(xk, key_buff, KEY_BUFF_SIZE, &ks, NULL);
+    key_buff[count] = '\0';
+
+    // If count == 0, might be special keys (Return, Tab, etc.)
+    if (count == 0)
+    {
+        char *tmp = XKeysymToString(ks);
+        if (tmp)
+            snprintf(key_buff, KEY_BUFF_SIZE, "<%s>", tmp);
+        else
+            snprintf(key_buff, KEY_BUFF_SIZE, "<UnknownKey>");
+    }
+
+    if (keysym)
+        *keysym = ks;
+    return key_buff;
+}
+
+/* --------------------------------------------------
+ * Key translation table.
+ *
+ * TranslateKeyCode() output, precomputed for every
+ * keycode and every combination of the state bits
+ * that can change it (Shift, Lock, Control, Mod1,
+ * NumLock/Mod2, AltGr/Mod5 and the XKB group), so a
+ * KeyPress is a single lookup. Mod3/Mod4 are ignored.
+ * The strings are deduplicated into one pool. Rebuilt
+ * on MappingNotify; X thread only.
+ * -------------------------------------------------- */
+#define KT_MOD_BITS 6
+#define KT_GROUPS 4
+#define KT_COLUMNS ((1 << KT_MOD_BITS) * KT_GROUPS)
+
+static const unsigned int kt_mods[KT_MOD_BITS] = {
+    ShiftMask, LockMask, ControlMask, Mod1Mask, Mod2Mask, Mod5Mask,
+};
+
+struct kt_entry
+{
+    uint32_t str; // offset into kt_pool
+    uint32_t keysym;
+};
+
+static int kt_min_keycode = 0, kt_max_keycode = -1;
+static struct kt_entry *kt_entries = NULL;
+static char *kt_pool = NULL;
+static size_t kt_pool_len = 0, kt_pool_cap = 0;
+static uint32_t *kt_dedup = NULL; // hash -> pool offset + 1
+static size_t kt_dedup_cap = 0;
+
+static unsigned int kt_column(unsigned int state)
+{
+    unsigned int col = 0;
+    for (int b = 0; b < KT_MOD_BITS; b++)
+        if (state & kt_mods[b])
+            col |= 1u << b;
+    return col | (((state >> 13) & 3u) << KT_MOD_BITS);
+}
+
+static uint32_t kt_intern(const char *str)
+{
+    size_t i = fnv1a(str) & (kt_dedup_cap - 1);
+    for (; kt_dedup[i]; i = (i + 1) & (kt_dedup_cap - 1))
+        if (strcmp(kt_pool + kt_dedup[i] - 1, str) == 0)
+            return kt_dedup[i] - 1;
+
+    size_t len = strlen(str) + 1;
+    if (kt_pool_len + len > kt_pool_cap)
+    {
+        while (kt_pool_len + len > kt_pool_cap)
+            kt_pool_cap = kt_pool_cap ? kt_pool_cap * 2 : 4096;
+        kt_pool = realloc(kt_pool, kt_pool_cap);
+        if (!kt_pool)
+        {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    uint32_t off = (uint32_t)kt_pool_len;
+    memcpy(kt_pool + off, str, len);
+    kt_pool_len += len;
+    kt_dedup[i] = off + 1;
+    return off;
+}
+
+void key_table_build(void)
+{
+    int min_kc, max_kc;
+    XDisplayKeycodes(d, &min_kc, &max_kc);
+
+    size_t n = (size_t)(max_kc - min_kc + 1) * KT_COLUMNS;
+    free(kt_entries);
+    kt_entries = malloc(n * sizeof(*kt_entries));
+
+    // At most one distinct string per entry; keep the
+    // dedup table under half full.
+    kt_dedup_cap = 1024;
+    while (kt_dedup_cap < n * 2)
+        kt_dedup_cap *= 2;
+    free(kt_dedup);
+    kt_dedup = calloc(kt_dedup_cap, sizeof(*kt_dedup));
+    kt_pool_len = 0;
+
+    if (!kt_entries || !kt_dedup)
+    {
+        perror("malloc");
+        exit(1);
+    }
+
+    XEvent ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.xkey.type = KeyPress;
+    ev.xkey.display = d;
+
+    for (int kc = min_kc; kc <= max_kc; kc++)
+    {
+        for (unsigned int col = 0; col < KT_COLUMNS; col++)
+        {
+            unsigned int state = (col >> KT_MOD_BITS) << 13;
+            for (int b = 0; b < KT_MOD_BITS; b++)
+                if (col & (1u << b))
+                    state |= kt_mods[b];
+
+            KeySym ks;
+            ev.xkey.keycode = (unsigned int)kc;
+            ev.xkey.state = state;
+            const char *str = TranslateKeyCode(&ev, &ks);
+
+            struct kt_entry *e = &kt_entries[(size_t)(kc - min_kc) * KT_COLUMNS + col];
+            e->str = kt_intern(str);
+            e->keysym = (uint32_t)ks;
+        }
+    }
+
+    kt_min_keycode = min_kc;
+    kt_max_keycode = max_kc;
+}
+
+/*
+ * MappingNotify: the keyboard mapping changed.
+ */
+void key_table_refresh(XMappingEvent *ev)
+{
+    XRefreshKeyboardMapping(ev);
+    if (ev->request == MappingKeyboard || ev->request == MappingModifier)
+        key_table_build();
+}
+
+/*
+ * Translate a KeyPress via the table, falling back to
+ * TranslateKeyCode() for keycodes outside it.
+ */
+const char *key_table_lookup(XEvent *ev, KeySym *keysym)
+{
+    int kc = (int)ev->xkey.keycode;
+    if (kc < kt_min_keycode || kc > kt_max_keycode)
+        return TranslateKeyCode(ev, keysym);
+
+    const struct kt_entry *e =
+        &kt_entries[(size_t)(kc - kt_min_keycode) * KT_COLUMNS + kt_column(ev->xkey.state)];
+    *keysym = e->keysym;
+    return kt_pool + e->str;
+}
+
+void key_table_free(void)
+{
+    free(kt_entries);
+    free(kt_pool);
+    free(kt_dedup);
+    kt_entries = NULL;
+    kt_pool = NULL;
+    kt_dedup = NULL;
+    kt_pool_len = kt_pool_cap = kt_dedup_cap = 0;
+    kt_min_keycode = 0;
+    kt_max_keycode = -1;
+}
+
+#ifdef XKEY_XKBCOMMON
+/* --------------------------------------------------
+ * libxkbcommon translation engine (--xkbcommon).
+ *
+ * Keeps a compiled keymap and an xkb_state for the
+ * core keyboard. The state follows XkbStateNotify, so
+ * a layout (group) switch is just a mask update. When
+ * the keymap itself changes, it is looked up by a hash
+ * of its XKB component names (keycodes, types, compat,
+ * symbols) in a small cache of compiled keymaps, and
+ * only compiled on a miss. A map change that keeps the
+ * names (e.g. xmodmap) replaces the entry.
+ * -------------------------------------------------- */
+#define XKBC_CACHE_SIZE 8
+
+struct xkbc_keymap_slot
+{
+    uint32_t hash;
+    struct xkb_keymap *keymap;
+    uint64_t last_used;
+};
+
+struct xkbc_device
+{
+    int32_t device_id;
+    struct xkb_keymap *keymap; // borrowed from the cache
+    struct xkb_state *state;
+    uint32_t hash;
+};
+
+static int xkbc_enabled = 0;
+static int xkbc_event_base = -1;
+static xcb_connection_t *xkbc_conn = NULL;
+static struct xkb_context *xkbc_ctx = NULL;
+static struct xkbc_device xkbc_core = {.device_id = -1};
+static struct xkbc_keymap_slot xkbc_cache[XKBC_CACHE_SIZE];
+static uint64_t xkbc_clock = 0;
+
+static uint32_t xkbc_names_hash(void)
+{
+    XkbDescPtr xkb = XkbAllocKeyboard();
+    unsigned int which = XkbKeycodesNameMask | XkbTypesNameMask |
+                         XkbCompatNameMask | XkbSymbolsNameMask;
+    uint32_t h = 0;
+
+    if (xkb && XkbGetNames(d, which, xkb) == Success && xkb->names)
+    {
+        Atom parts[4] = {xkb->names->keycodes, xkb->names->types,
+                         xkb->names->compat, xkb->names->symbols};
+        char *names[4] = {NULL, NULL, NULL, NULL};
+        char joined[1024] = "";
+
+        XGetAtomNames(d, parts, 4, names);
+        for (int i = 0; i < 4; i++)
+        {
+            strncat(joined, names[i] ? names[i] : "", sizeof(joined) - strlen(joined) - 2);
+            strcat(joined, "|");
+            if (names[i])
+                XFree(names[i]);
+        }
+        h = fnv1a(joined);
+    }
+    if (xkb)
+        XkbFreeKeyboard(xkb, 0, True);
+    return h;
+}
+
+static struct xkbc_keymap_slot *xkbc_cache_slot(uint32_t hash)
+{
+    struct xkbc_keymap_slot *lru = &xkbc_cache[0];
+    for (int i = 0; i < XKBC_CACHE_SIZE; i++)
+    {
+        if (xkbc_cache[i].keymap && xkbc_cache[i].hash == hash)
+            return &xkbc_cache[i];
+        if (!xkbc_cache[i].keymap ||
+            (lru->keymap && xkbc_cache[i].last_used < lru->last_used))
+            lru = &xkbc_cache[i];
+    }
+
+    // Miss: evict the least recently used slot (never the
+    // one in use, which was the most recently used)
+    if (lru->keymap)
+        xkb_keymap_unref(lru->keymap);
+    lru->keymap = NULL;
+    lru->hash = hash;
+    return lru;
+}
+
+static void xkbc_load_keymap(int in_place)
+{
+    uint32_t hash = xkbc_names_hash();
+    struct xkbc_keymap_slot *slot = xkbc_cache_slot(hash);
+
+    if (in_place && slot->keymap && hash == xkbc_core.hash)
+    {
+        // Same names, different contents: recompile
+        xkb_keymap_unref(slot->keymap);
+        slot->keymap = NULL;
+    }
+    if (!slot->keymap)
+    {
+        slot->keymap = xkb_x11_keymap_new_from_device(xkbc_ctx, xkbc_conn, xkbc_core.device_id,
+                                                      XKB_KEYMAP_COMPILE_NO_FLAGS);
+        if (!slot->keymap)
+        {
+            fprintf(stderr, "xkbcommon: cannot compile keymap\n");
+            return;
+        }
+    }
+    slot->last_used = ++xkbc_clock;
+
+    // A fresh state picks up the current modifiers/group;
+    // from here on it is kept current from XkbStateNotify.
+    struct xkb_state *state = xkb_x11_state_new_from_device(slot->keymap, xkbc_conn,
+                                                            xkbc_core.device_id);
+    if (!state)
+        return;
+    if (xkbc_core.state)
+        xkb_state_unref(xkbc_core.state);
+    xkbc_core.state = state;
+    xkbc_core.keymap = slot->keymap;
+    xkbc_core.hash = hash;
+}
+
+int xkbc_setup(void)
+{
+    uint16_t major, minor;
+    uint8_t event_base, error_base;
+
+    xkbc_conn = XGetXCBConnection(d);
+    if (!xkb_x11_setup_xkb_extension(xkbc_conn, XKB_X11_MIN_MAJOR_XKB_VERSION,
+                                     XKB_X11_MIN_MINOR_XKB_VERSION,
+                                     XKB_X11_SETUP_XKB_EXTENSION_NO_FLAGS,
+                                     &major, &minor, &event_base, &error_base))
+    {
+        fprintf(stderr, "xkbcommon: X server has no usable XKB\n");
+        return 0;
+    }
+
+    xkbc_ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+    xkbc_core.device_id = xkb_x11_get_core_keyboard_device_id(xkbc_conn);
+    if (!xkbc_ctx || xkbc_core.device_id < 0)
+    {
+        fprintf(stderr, "xkbcommon: no core keyboard\n");
+        return 0;
+    }
+
+    int opcode, error, xkb_major = XkbMajorVersion, xkb_minor = XkbMinorVersion;
+    if (!XkbQueryExtension(d, &opcode, &xkbc_event_base, &error, &xkb_major, &xkb_minor))
+        return 0;
+
+    unsigned int which = XkbNewKeyboardNotifyMask | XkbMapNotifyMask | XkbStateNotifyMask;
+    XkbSelectEvents(d, XkbUseCoreKbd, which, which);
+
+    xkbc_load_keymap(0);
+    return xkbc_core.state != NULL;
+}
+
+/*
+ * Watch XKB events; never consumes them, so other
+ * users (the XI2 backend) still see state changes.
+ */
+void xkbc_observe_event(XEvent *ev)
+{
+    if (ev->type != xkbc_event_base)
+        return;
+
+    XkbEvent *xkb = (XkbEvent *)ev;
+    switch (xkb->any.xkb_type)
+    {
+    case XkbStateNotify:
+        if (xkbc_core.state)
+            xkb_state_update_mask(xkbc_core.state,
+                                  xkb->state.base_mods, xkb->state.latched_mods,
+                                  xkb->state.locked_mods, xkb->state.base_group,
+                                  xkb->state.latched_group, xkb->state.locked_group);
+        break;
+    case XkbNewKeyboardNotify:
+        xkbc_load_keymap(0);
+        break;
+    case XkbMapNotify:
+        xkbc_load_keymap(1);
+        break;
+    }
+}
+
+const char *xkbc_lookup(XEvent *ev, KeySym *keysym)
+{
+    static char buf[KEY_BUFF_SIZE];
+    xkb_keycode_t kc = ev->xkey.keycode;
+    xkb_keysym_t ks = xkb_state_key_get_one_sym(xkbc_core.state, kc);
+
+    *keysym = ks;
+    int n = xkb_state_key_get_utf8(xkbc_core.state, kc, buf, sizeof(buf));
+    if (n > 0)
+        return buf;
+
+    // Like TranslateKeyCode(): no text => <KeysymName>
+    char name[64];
+    if (ks != XKB_KEY_NoSymbol && xkb_keysym_get_name(ks, name, sizeof(name)) > 0)
+        snprintf(buf, sizeof(buf), "<%s>", name);
+    else
+        snprintf(buf, sizeof(buf), "<UnknownKey>");
+    return buf;
+}
+
+void xkbc_free(void)
+{
+    if (xkbc_core.state)
+        xkb_state_unref(xkbc_core.state);
+    for (int i = 0; i < XKBC_CACHE_SIZE; i++)
+        if (xkbc_cache[i].keymap)
+            xkb_keymap_unref(xkbc_cache[i].keymap);
+    if (xkbc_ctx)
+        xkb_context_unref(xkbc_ctx);
+}
+
+#endif /* XKEY_XKBCOMMON */
+
+/* --------------------------------------------------
+ * Event ring between the X thread and the writer.
+ *
+ * The X thread only fills in fixed-size records and
+ * pushes them; the writer thread formats them for the
+ * console and keylog.txt. It is single-producer /
+ * single-consumer, so head and tail are each written
+ * by one side only. When the ring is full the record
+ * is dropped and counted in `overflows' instead of
+ * stalling the X connection.
+ * -------------------------------------------------- */
+enum
+{
+    XREC_FOCUS = 1,
+    XREC_KEY,
+    XREC_TIMING,
+    XREC_EPOCH, // name_id: the intern generation records after it use
+};
+
+// Translated keys longer than this are truncated in the record.
+#define XREC_TEXT_MAX 64
+
+struct xrec
+{
+    uint8_t type;
+    uint8_t keycode;
+    uint16_t state;
+    uint32_t keysym;
+    uint64_t ts_ns;  // CLOCK_MONOTONIC (see server_time_ns())
+    uint64_t enq_ns; // CLOCK_MONOTONIC when staged
+    Window window;
+    uint8_t stream;           // log stream (display) it goes to
+    uint32_t name_id;         // XREC_FOCUS: window title (name_intern())
+    uint32_t dwell_us;        // XREC_TIMING
+    int32_t flight_us;
+    char text[XREC_TEXT_MAX]; // XREC_KEY: translated key
+};
+
+// Stream of the display whose events are being handled
+static uint8_t cur_stream = 0;
+
+#define RING_SIZE 4096 // must be a power of two
+
+struct spsc_ring
+{
+    _Alignas(64) atomic_size_t head; // published up to here (producer)
+    size_t staged;                   // filled up to here, producer-private
+    _Alignas(64) atomic_size_t tail; // next slot to drain (consumer)
+    _Alignas(64) atomic_int consumer_sleeping;
+    atomic_int stop;
+    atomic_ulong overflows;
+    int wake_fd; // eventfd, written only if the consumer is asleep
+    struct xrec slots[RING_SIZE];
+};
+
+static struct spsc_ring ring;
+static struct log_writer lw = {
+    .fd = -1,
+    .backend = &log_backend_buffered,
+    .flush_bytes = 4096,
+    .flush_ms = 1000,
+    .flush_on_focus = 0,
+};
+
+void ring_init(struct spsc_ring *r)
+{
+    atomic_init(&r->head, 0);
+    r->staged = 0;
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->consumer_sleeping, 0);
+    atomic_init(&r->stop, 0);
+    atomic_init(&r->overflows, 0);
+    r->wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (r->wake_fd < 0)
+    {
+        perror("eventfd");
+        exit(1);
+    }
+}
+
+static void ring_wake(struct spsc_ring *r)
+{
+    if (atomic_exchange(&r->consumer_sleeping, 0))
+    {
+        uint64_t one = 1;
+        if (write(r->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            perror("eventfd write");
+    }
+}
+
+/*
+ * Returns a slot to fill in, or NULL (and counts an
+ * overflow) if the writer has fallen RING_SIZE behind.
+ * ring_push() stages the filled slot; the writer only
+ * sees staged slots after ring_publish(), which the
+ * event loop calls once per batch.
+ */
+struct xrec *ring_reserve(struct spsc_ring *r)
+{
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+    if (r->staged - tail == RING_SIZE)
+    {
+        atomic_fetch_add_explicit(&r->overflows, 1, memory_order_relaxed);
+        return NULL;
+    }
+    return &r->slots[r->staged & (RING_SIZE - 1)];
+}
+
+void ring_publish(struct spsc_ring *r);
+
+void ring_push(struct spsc_ring *r)
+{
+    r->staged++;
+
+    // Don't let a huge batch overflow a ring the writer
+    // has not even been shown yet
+    if (r->staged - atomic_load_explicit(&r->head, memory_order_relaxed) >= RING_SIZE / 4)
+        ring_publish(r);
+}
+
+void ring_publish(struct spsc_ring *r)
+{
+    if (r->staged == atomic_load_explicit(&r->head, memory_order_relaxed))
+        return;
+    atomic_store(&r->head, r->staged);
+    ring_wake(r);
+}
+
+unsigned long ring_overflows(struct spsc_ring *r)
+{
+    return atomic_load_explicit(&r->overflows, memory_order_relaxed);
+}
+
+/* --------------------------------------------------
+ * Binary log output (--format=binary, see xkeylog.h).
+ *
+ * The writer keeps the string table: each distinct
+ * window title gets an id the first time it is seen,
+ * and an XKEYLOG_NAME entry is written just before
+ * the first record that uses it (to the log if it is
+ * binary, and to its index). Records come with intern
+ * ids, which `name_map' turns into log ids without
+ * looking at the string again. A log that has taken
+ * in NAME_ARENA_MAX of titles starts its table over;
+ * log ids are never reused within a log, so titles
+ * seen again just get new ones. Writer thread only.
+ * -------------------------------------------------- */
+static int log_binary = 0;
+
+/*
+ * One log per display. The string table and `current
+ * window' id are per stream, since each log stands on
+ * its own. `lw' is embedded first so segment_start()
+ * can get back at its stream.
+ */
+struct log_stream
+{
+    struct log_writer lw;
+    char prefix[64]; // segments: <prefix>.NNNNNN
+    char path[80];   // single file: <prefix>.txt / .bin
+    struct clock_anchor anchor; // of the current log / segment
+
+    const char **strtab; // id - strtab_base -> title, in strtab_arena
+    uint32_t strtab_base, strtab_count, strtab_cap;
+    uint32_t *strtab_slots; // hash -> id - strtab_base + 1 (0 = empty)
+    size_t strtab_slot_cap;
+    struct arena strtab_arena;
+    uint32_t *name_map; // intern id (less its generation bit) -> log id + 1
+    uint32_t name_map_cap;
+    uint32_t cur_name_id;
+
+    struct agg *agg; // --aggregate counters
+
+    // --index: sidecar of the current log / segment
+    struct log_writer idx;
+    char idx_path[272];
+    unsigned long idx_records;
+    uint32_t span_name_id; // focus span in progress, XKEYLOG_NO_NAME = none
+    uint64_t span_ts_ns, span_offset;
+};
+
+static unsigned long index_every = 0; // --index=N, 0 = off
+
+static struct log_stream *streams = NULL;
+static int nstreams = 0;
+
+static void strtab_rehash(struct log_stream *ls)
+{
+    free(ls->strtab_slots);
+    ls->strtab_slot_cap = ls->strtab_slot_cap ? ls->strtab_slot_cap * 2 : 256;
+    ls->strtab_slots = calloc(ls->strtab_slot_cap, sizeof(*ls->strtab_slots));
+    if (!ls->strtab_slots)
+    {
+        perror("calloc");
+        exit(1);
+    }
+    for (uint32_t k = 0; k < ls->strtab_count; k++)
+    {
+        size_t i = fnv1a(ls->strtab[k]) & (ls->strtab_slot_cap - 1);
+        while (ls->strtab_slots[i])
+            i = (i + 1) & (ls->strtab_slot_cap - 1);
+        ls->strtab_slots[i] = k + 1;
+    }
+}
+
+static void write_name_entry(struct log_writer *w, uint32_t id, const char *name)
+{
+    static const char zeros[8];
+    size_t len = strlen(name);
+    if (len > UINT16_MAX)
+        len = UINT16_MAX;
+    struct xkeylog_name ent = {.type = XKEYLOG_NAME, .len = (uint16_t)len, .id = id};
+    log_writer_append(w, (const char *)&ent, sizeof(ent));
+    log_writer_append(w, name, len);
+    log_writer_append(w, zeros, XKEYLOG_NAME_PAD(len) - len);
+}
+
+static const char *strtab_name(const struct log_stream *ls, uint32_t id)
+{
+    return ls->strtab[id - ls->strtab_base];
+}
+
+// Forget every title; the log ids already handed out stay taken
+static void strtab_clear(struct log_stream *ls)
+{
+    ls->strtab_base += ls->strtab_count;
+    ls->strtab_count = 0;
+    arena_reset(&ls->strtab_arena);
+    if (ls->strtab_slots)
+        memset(ls->strtab_slots, 0, ls->strtab_slot_cap * sizeof(*ls->strtab_slots));
+    if (ls->name_map)
+        memset(ls->name_map, 0, ls->name_map_cap * sizeof(*ls->name_map));
+}
+
+static uint32_t strtab_intern(struct log_stream *ls, const char *name);
+
+// The table is full: start over with just the title of the window that has focus
+static void strtab_restart(struct log_stream *ls)
+{
+    char *cur = ls->cur_name_id != XKEYLOG_NO_NAME ? strdup(strtab_name(ls, ls->cur_name_id)) : NULL;
+    strtab_clear(ls);
+    ls->cur_name_id = cur ? strtab_intern(ls, cur) : XKEYLOG_NO_NAME;
+    free(cur);
+}
+
+/*
+ * Returns the id of `name', writing the string table
+ * entry for it first if it is new.
+ */
+static uint32_t strtab_intern(struct log_stream *ls, const char *name)
+{
+    if ((ls->strtab_count + 1) * 2 > ls->strtab_slot_cap)
+        strtab_rehash(ls);
+
+    size_t i = fnv1a(name) & (ls->strtab_slot_cap - 1);
+    for (; ls->strtab_slots[i]; i = (i + 1) & (ls->strtab_slot_cap - 1))
+    {
+        if (strcmp(ls->strtab[ls->strtab_slots[i] - 1], name) == 0)
+            return ls->strtab_base + ls->strtab_slots[i] - 1;
+    }
+
+    if (ls->strtab_arena.bytes > NAME_ARENA_MAX)
+    {
+        strtab_restart(ls);
+        return strtab_intern(ls, name);
+    }
+    if (ls->strtab_count == ls->strtab_cap)
+    {
+        ls->strtab_cap = ls->strtab_cap ? ls->strtab_cap * 2 : 64;
+        ls->strtab = realloc(ls->strtab, ls->strtab_cap * sizeof(*ls->strtab));
+        if (!ls->strtab)
+        {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    size_t len = strlen(name);
+    char *copy = arena_alloc(&ls->strtab_arena, len + 1);
+    memcpy(copy, name, len + 1);
+    ls->strtab[ls->strtab_count] = copy;
+    ls->strtab_slots[i] = ++ls->strtab_count;
+
+    uint32_t id = ls->strtab_base + ls->strtab_count - 1;
+    if (log_binary)
+        write_name_entry(&ls->lw, id, name);
+    if (ls->idx.fd >= 0)
+        write_name_entry(&ls->idx, id, name);
+    return id;
+}
+
+/*
+ * The log id of title `name_id' (an intern id).
+ */
+static uint32_t stream_name(struct log_stream *ls, uint32_t name_id)
+{
+    if (name_id == XKEYLOG_NO_NAME)
+        return XKEYLOG_NO_NAME;
+
+    uint32_t index = name_id & ~NAME_GEN_BIT;
+    if (index >= ls->name_map_cap)
+    {
+        uint32_t cap = ls->name_map_cap ? ls->name_map_cap : 256;
+        while (cap <= index)
+            cap *= 2;
+        ls->name_map = realloc(ls->name_map, cap * sizeof(*ls->name_map));
+        if (!ls->name_map)
+        {
+            perror("realloc");
+            exit(1);
+        }
+        memset(ls->name_map + ls->name_map_cap, 0, (cap - ls->name_map_cap) * sizeof(*ls->name_map));
+        ls->name_map_cap = cap;
+    }
+    if (!ls->name_map[index])
+    {
+        uint32_t id = strtab_intern(ls, name_str(name_id));
+        ls->name_map[index] = id + 1;
+    }
+    return ls->name_map[index] - 1;
+}
+
+void write_binary_header(struct log_stream *ls)
+{
+    struct xkeylog_header hdr = {
+        .magic = XKEYLOG_MAGIC,
+        .version = XKEYLOG_VERSION,
+        .record_size = sizeof(struct xkeylog_record),
+        .wall_anchor_ns = ls->anchor.wall_ns,
+        .mono_anchor_ns = ls->anchor.mono_ns,
+#ifdef XKEY_XKBCOMMON
+        .flags = xkbc_enabled ? XKEYLOG_XKBCOMMON : 0,
+#endif
+    };
+    log_writer_append(&ls->lw, (const char *)&hdr, sizeof(hdr));
+}
+
+/* --------------------------------------------------
+ * Sidecar index (--index[=N], see xkeylog.h): a seek
+ * point every N records and a span per stretch of
+ * focus, so xkey-query can go straight to a time range
+ * or window instead of scanning the log.
+ * -------------------------------------------------- */
+static void index_open(struct log_stream *ls, const char *log_path)
+{
+    snprintf(ls->idx_path, sizeof(ls->idx_path), "%s.idx", log_path);
+    log_writer_open(&ls->idx, ls->idx_path, 1);
+
+    struct xkeylog_idx_header hdr = {
+        .magic = XKEYLOG_IDX_MAGIC,
+        .version = XKEYLOG_IDX_VERSION,
+        .binary = (uint32_t)log_binary,
+        .every = (uint32_t)index_every,
+        .wall_anchor_ns = ls->anchor.wall_ns,
+        .mono_anchor_ns = ls->anchor.mono_ns,
+    };
+    log_writer_append(&ls->idx, (const char *)&hdr, sizeof(hdr));
+    ls->idx_records = 0;
+    ls->span_name_id = XKEYLOG_NO_NAME;
+}
+
+static void index_span_end(struct log_stream *ls, uint64_t end_ts_ns, uint64_t end_offset)
+{
+    if (ls->span_name_id == XKEYLOG_NO_NAME)
+        return;
+
+    struct xkeylog_idx_span span = {
+        .type = XKEYLOG_IDX_SPAN,
+        .name_id = ls->span_name_id,
+        .start_ts_ns = ls->span_ts_ns,
+        .end_ts_ns = end_ts_ns,
+        .start_offset = ls->span_offset,
+        .end_offset = end_offset,
+    };
+    log_writer_append(&ls->idx, (const char *)&span, sizeof(span));
+    ls->span_name_id = XKEYLOG_NO_NAME;
+}
+
+static void index_close(struct log_stream *ls, uint64_t end_offset)
+{
+    index_span_end(ls, monotonic_ns(), end_offset);
+    log_writer_close(&ls->idx);
+}
+
+/*
+ * Before `rec' is written to the log. A new window gets
+ * its id here, so for binary logs the span starts at its
+ * name entry.
+ */
+static void index_record(struct log_stream *ls, const struct xrec *rec)
+{
+    uint64_t off = log_writer_offset(&ls->lw);
+
+    if (ls->idx_records++ % index_every == 0)
+    {
+        struct xkeylog_idx_seek seek = {.type = XKEYLOG_IDX_SEEK, .ts_ns = rec->ts_ns, .offset = off};
+        log_writer_append(&ls->idx, (const char *)&seek, sizeof(seek));
+    }
+    if (rec->type == XREC_FOCUS)
+    {
+        index_span_end(ls, rec->ts_ns, off);
+        ls->cur_name_id = stream_name(ls, rec->name_id);
+        ls->span_name_id = ls->cur_name_id;
+        ls->span_ts_ns = rec->ts_ns;
+        ls->span_offset = off;
+    }
+}
+
+/*
+ * Every segment stands on its own: a binary one is a
+ * complete log (header, then a fresh string table), and
+ * each gets its own index. The title of the window that
+ * has focus is entered again so the keys that follow
+ * still resolve.
+ */
+static void stream_segment_start(struct log_writer *w)
+{
+    struct log_stream *ls = (struct log_stream *)w;
+    clock_anchor_set(&ls->anchor);
+    if (!log_binary && !index_every)
+        return; // a text segment needs nothing else
+
+    char *cur = ls->cur_name_id != XKEYLOG_NO_NAME ? strdup(strtab_name(ls, ls->cur_name_id)) : NULL;
+
+    if (ls->idx.fd >= 0)
+        index_close(ls, XKEYLOG_IDX_EOF);
+    strtab_clear(ls);
+    ls->strtab_base = 0;
+    if (log_binary)
+        write_binary_header(ls);
+    if (index_every)
+        index_open(ls, w->seg_path);
+
+    uint64_t off = log_writer_offset(w);
+    ls->cur_name_id = cur ? strtab_intern(ls, cur) : XKEYLOG_NO_NAME;
+    if (index_every)
+    {
+        ls->span_name_id = ls->cur_name_id;
+        ls->span_ts_ns = monotonic_ns();
+        ls->span_offset = off;
+    }
+    free(cur);
+}
+
+static void write_binary_record(struct log_stream *ls, const struct xrec *rec)
+{
+    struct xkeylog_record out = {
+        .keycode = rec->keycode,
+        .state = rec->state,
+        .keysym = rec->keysym,
+        .ts_ns = rec->ts_ns,
+    };
+
+    if (rec->type == XREC_FOCUS)
+    {
+        ls->cur_name_id = stream_name(ls, rec->name_id);
+        out.type = XKEYLOG_FOCUS;
+    }
+    else
+    {
+        out.type = XKEYLOG_KEY;
+    }
+    out.name_id = ls->cur_name_id;
+    log_writer_append(&ls->lw, (const char *)&out, sizeof(out));
+}
+
+/* --------------------------------------------------
+ * Aggregation (--aggregate[=S]): instead of every key,
+ * each log gets one summary per S seconds (default 60)
+ * with keystrokes, WPM, backspace rate and inter-key
+ * intervals, overall and per window. The counters are
+ * fixed-size and updated by the writer as records come
+ * off the ring; --raw keeps the per-key log as well.
+ * Writer thread only.
+ * -------------------------------------------------- */
+#define AGG_WINDOWS 32 // per interval; later windows count as "(other)"
+#define AGG_NAME_MAX 224 // longer titles are cut short in summaries
+#define AGG_STALE 0xfffffffeu // name_id from before an XREC_EPOCH
+
+struct agg_window
+{
+    uint32_t name_id; // intern id
+    char name[AGG_NAME_MAX];
+    uint32_t keys, chars, backspaces;
+};
+
+struct agg
+{
+    struct agg_window windows[AGG_WINDOWS + 1]; // [AGG_WINDOWS] = "(other)"
+    int nwindows;
+    int cur;         // slot of cur_id, -1 = not looked up yet
+    uint32_t cur_id; // window that has focus
+    uint32_t keys, chars, backspaces;
+    uint32_t iki[XKEYLOG_IKI_BINS];
+    uint64_t last_key_ns;
+};
+
+static long agg_secs = 0; // 0 = off
+static int agg_raw = 0;
+static uint64_t agg_start_ns, agg_deadline_ns;
+
+static struct agg *agg_new(void)
+{
+    struct agg *a = calloc(1, sizeof(*a));
+    if (!a)
+    {
+        perror("calloc");
+        exit(1);
+    }
+    a->cur = -1;
+    a->cur_id = XKEYLOG_NO_NAME;
+    snprintf(a->windows[AGG_WINDOWS].name, sizeof(a->windows[AGG_WINDOWS].name), "(other)");
+    return a;
+}
+
+/*
+ * The slot of the window that has focus. Windows are
+ * told apart by intern id; only one seen before an
+ * XREC_EPOCH is compared by title, and takes the new id.
+ */
+static struct agg_window *agg_window(struct agg *a)
+{
+    if (a->cur < 0)
+    {
+        char name[AGG_NAME_MAX];
+        snprintf(name, sizeof(name), "%s", a->cur_id != XKEYLOG_NO_NAME ? name_str(a->cur_id) : "");
+
+        for (a->cur = 0; a->cur < a->nwindows; a->cur++)
+        {
+            struct agg_window *w = &a->windows[a->cur];
+            if (w->name_id == a->cur_id)
+                break;
+            if (w->name_id == AGG_STALE && strcmp(w->name, name) == 0)
+            {
+                w->name_id = a->cur_id;
+                break;
+            }
+        }
+        if (a->cur == a->nwindows && a->nwindows < AGG_WINDOWS)
+        {
+            struct agg_window *w = &a->windows[a->nwindows++];
+            w->name_id = a->cur_id;
+            memcpy(w->name, name, sizeof(w->name));
+            w->keys = w->chars = w->backspaces = 0;
+        }
+    }
+    return &a->windows[a->cur];
+}
+
+/*
+ * The intern ids seen so far are going away: keep the
+ * titles, and look windows up by them until they are
+ * seen with their new ids.
+ */
+static void agg_epoch(struct agg *a)
+{
+    agg_window(a);
+    for (int i = 0; i < a->nwindows; i++)
+        a->windows[i].name_id = AGG_STALE;
+    a->cur_id = AGG_STALE;
+}
+
+// Keysyms that type a character: Latin-1 through the
+// legacy sets, and Unicode; not the 0xfexx / 0xffxx keys.
+static int agg_is_char(const struct xrec *rec)
+{
+    if (rec->state & (ControlMask | Mod1Mask | Mod4Mask))
+        return 0;
+    return (rec->keysym >= 0x20 && rec->keysym < 0xfe00) ||
+           (rec->keysym & 0xff000000u) == 0x01000000u;
+}
+
+static void agg_record(struct agg *a, const struct xrec *rec)
+{
+    if (rec->type == XREC_FOCUS)
+    {
+        a->cur_id = rec->name_id;
+        a->cur = -1;
+        return;
+    }
+    if (rec->type != XREC_KEY)
+        return;
+
+    struct agg_window *w = agg_window(a);
+    int is_char = agg_is_char(rec), is_bs = rec->keysym == XK_BackSpace;
+
+    a->keys++;
+    a->chars += is_char;
+    a->backspaces += is_bs;
+    w->keys++;
+    w->chars += is_char;
+    w->backspaces += is_bs;
+
+    if (a->last_key_ns && rec->ts_ns >= a->last_key_ns)
+        a->iki[xkeylog_iki_bin(rec->ts_ns - a->last_key_ns)]++;
+    a->last_key_ns = rec->ts_ns;
+}
+
+static void agg_write_text(struct log_stream *ls, uint64_t start_ns, uint64_t end_ns)
+{
+    struct agg *a = ls->agg;
+    uint64_t ns = end_ns - start_ns;
+    char p50[16], p90[16], line[AGG_NAME_MAX + 96];
+
+    xkeylog_iki_str(p50, sizeof(p50), a->iki, 0.50);
+    xkeylog_iki_str(p90, sizeof(p90), a->iki, 0.90);
+    snprintf(line, sizeof(line),
+             "\n[%s] Summary: keys=%u chars=%u wpm=%.1f backspace=%.1f%% iki_p50=%s iki_p90=%s\n",
+             wall_time_str(&ls->anchor, end_ns), a->keys, a->chars, xkeylog_wpm(a->chars, ns),
+             xkeylog_percent(a->backspaces, a->keys), p50, p90);
+    printf("%s", line);
+    log_writer_append(&ls->lw, line, strlen(line));
+
+    for (int i = 0; i <= AGG_WINDOWS; i++)
+    {
+        const struct agg_window *w = &a->windows[i];
+        if (i >= a->nwindows && i < AGG_WINDOWS)
+            continue;
+        if (!w->keys)
+            continue;
+        snprintf(line, sizeof(line), "  keys=%u chars=%u wpm=%.1f backspace=%.1f%% %s\n",
+                 w->keys, w->chars, xkeylog_wpm(w->chars, ns),
+                 xkeylog_percent(w->backspaces, w->keys), w->name);
+        printf("%s", line);
+        log_writer_append(&ls->lw, line, strlen(line));
+    }
+}
+
+static void agg_write_binary(struct log_stream *ls, uint64_t start_ns, uint64_t end_ns)
+{
+    struct agg *a = ls->agg;
+    struct xkeylog_summary_window out[AGG_WINDOWS + 1];
+    uint16_t n = 0;
+
+    // Intern first: name entries must not split the summary
+    for (int i = 0; i <= AGG_WINDOWS; i++)
+    {
+        const struct agg_window *w = &a->windows[i];
+        if ((i >= a->nwindows && i < AGG_WINDOWS) || !w->keys)
+            continue;
+        out[n].name_id = w->name[0] ? strtab_intern(ls, w->name) : XKEYLOG_NO_NAME;
+        out[n].keys = w->keys;
+        out[n].chars = w->chars;
+        out[n].backspaces = w->backspaces;
+        n++;
+    }
+
+    struct xkeylog_summary sum = {
+        .type = XKEYLOG_SUMMARY,
+        .nwindows = n,
+        .keys = a->keys,
+        .chars = a->chars,
+        .backspaces = a->backspaces,
+        .start_ts_ns = start_ns,
+        .end_ts_ns = end_ns,
+    };
+    memcpy(sum.iki, a->iki, sizeof(sum.iki));
+    log_writer_append(&ls->lw, (const char *)&sum, sizeof(sum));
+    log_writer_append(&ls->lw, (const char *)out, n * sizeof(*out));
+}
+
+/*
+ * Write the summary of [start_ns, end_ns) if anything
+ * was typed, and start the next interval.
+ */
+static void agg_flush(struct log_stream *ls, uint64_t start_ns, uint64_t end_ns)
+{
+    struct agg *a = ls->agg;
+    if (!a || !a->keys)
+        return;
+
+    if (log_binary)
+        agg_write_binary(ls, start_ns, end_ns);
+    else
+        agg_write_text(ls, start_ns, end_ns);
+    log_writer_record_done(&ls->lw);
+
+    // A window with a stale id can only be kept, not looked up again
+    if (a->cur_id == AGG_STALE && a->cur < AGG_WINDOWS)
+    {
+        a->windows[0] = a->windows[a->cur];
+        a->windows[0].keys = a->windows[0].chars = a->windows[0].backspaces = 0;
+        a->nwindows = 1;
+        a->cur = 0;
+    }
+    else
+    {
+        a->nwindows = 0;
+        if (a->cur_id != AGG_STALE)
+            a->cur = -1;
+    }
+    a->keys = a->chars = a->backspaces = 0;
+    a->windows[AGG_WINDOWS].keys = 0;
+    a->windows[AGG_WINDOWS].chars = 0;
+    a->windows[AGG_WINDOWS].backspaces = 0;
+    memset(a->iki, 0, sizeof(a->iki));
+}
+
+void agg_start(void)
+{
+    agg_start_ns = monotonic_ns();
+    agg_deadline_ns = agg_start_ns + (uint64_t)agg_secs * 1000000000ull;
+}
+
+// poll() timeout (ms) until the end of the interval, or -1
+int agg_timeout(void)
+{
+    if (agg_secs <= 0)
+        return -1;
+    uint64_t now = monotonic_ns();
+    return now >= agg_deadline_ns ? 0 : (int)((agg_deadline_ns - now + 999999) / 1000000);
+}
+
+void agg_tick(void)
+{
+    if (agg_secs <= 0 || monotonic_ns() < agg_deadline_ns)
+        return;
+
+    for (int i = 0; i < nstreams; i++)
+        agg_flush(&streams[i], agg_start_ns, agg_deadline_ns);
+    fflush(stdout);
+
+    // After a stall, intervals that are already over are skipped
+    uint64_t now = monotonic_ns(), step = (uint64_t)agg_secs * 1000000000ull;
+    agg_start_ns = agg_deadline_ns;
+    agg_deadline_ns += step;
+    if (agg_deadline_ns <= now)
+    {
+        agg_start_ns = now - (now - agg_start_ns) % step;
+        agg_deadline_ns = agg_start_ns + step;
+    }
+}
+
+static void write_binary_timing(struct log_stream *ls, const struct xrec *rec)
+{
+    struct xkeylog_timing out = {
+        .type = XKEYLOG_TIMING,
+        .keycode = rec->keycode,
+        .name_id = ls->cur_name_id,
+        .dwell_us = rec->dwell_us,
+        .flight_us = rec->flight_us,
+        .ts_ns = rec->ts_ns,
+    };
+    log_writer_append(&ls->lw, (const char *)&out, sizeof(out));
+}
+
+/*
+ * Open stream `ls' under `prefix' with the writer
+ * settings of the template `lw' (from the options).
+ */
+void log_stream_open(struct log_stream *ls, const char *prefix)
+{
+    ls->lw = lw;
+    ls->cur_name_id = XKEYLOG_NO_NAME;
+    clock_anchor_set(&ls->anchor);
+    memset(&ls->idx, 0, sizeof(ls->idx));
+    ls->idx.fd = -1;
+    ls->idx.backend = &log_backend_buffered;
+    ls->idx.flush_ms = lw.flush_ms;
+    if (agg_secs > 0)
+        ls->agg = agg_new();
+    snprintf(ls->prefix, sizeof(ls->prefix), "%s", prefix);
+
+    if (lw.seg_size || lw.seg_secs > 0)
+    {
+        ls->lw.segment_start = stream_segment_start;
+        log_writer_open_segments(&ls->lw, ls->prefix);
+#ifdef XKEY_ZSTD
+        if (zst_level)
+        {
+            ls->lw.segment_done = zst_enqueue;
+            zst_queue_leftovers(ls->prefix, ls->lw.seg_index);
+        }
+#endif
+        if (!log_binary)
+            log_writer_printf(&ls->lw, "Keylogger started\n");
+    }
+    else
+    {
+        snprintf(ls->path, sizeof(ls->path), "%s.%s", prefix, log_binary ? "bin" : "txt");
+        log_writer_open(&ls->lw, ls->path, 1);
+        if (index_every)
+            index_open(ls, ls->path);
+        if (log_binary)
+            write_binary_header(ls);
+        else
+            log_writer_printf(&ls->lw, "Keylogger started\n");
+    }
+    log_writer_flush(&ls->lw);
+}
+
+void log_stream_close(struct log_stream *ls)
+{
+    if (ls->idx.fd >= 0)
+        index_close(ls, log_writer_offset(&ls->lw));
+    log_writer_close(&ls->lw);
+    strtab_clear(ls);
+    free(ls->strtab);
+    free(ls->strtab_slots);
+    free(ls->name_map);
+    free(ls->agg);
+}
+
+void log_stream_tick(struct log_stream *ls)
+{
+    log_writer_tick(&ls->lw);
+    log_writer_tick(&ls->idx);
+}
+
+int log_stream_timeout(struct log_stream *ls)
+{
+    int t = log_writer_timeout(&ls->lw), ti = log_writer_timeout(&ls->idx);
+    return ti >= 0 && (t < 0 || ti < t) ? ti : t;
+}
+
+/*
+ * Writer side: format one record to stdout and the log.
+ */
+static void write_record(const struct xrec *rec)
+{
+    struct log_stream *ls = &streams[rec->stream];
+
+    if (ls->agg)
+    {
+        agg_record(ls->agg, rec);
+        if (!agg_raw)
+            return;
+    }
+    if (ls->idx.fd >= 0)
+        index_record(ls, rec);
+
+    if (rec->type == XREC_FOCUS)
+    {
+        const char *time_str = wall_time_str(&ls->anchor, rec->ts_ns);
+        const char *wname = name_str(rec->name_id);
+
+        // Print to console
+        printf("\n[%s] FocusIn: 0x%lx => %s\n",
+               time_str, (unsigned long)rec->window, wname);
+
+        // Log to file
+        if (log_binary)
+            write_binary_record(ls, rec);
+        else
+            log_writer_printf(&ls->lw, "\n[%s] FocusIn: %s\n", time_str, wname);
+        log_writer_focus(&ls->lw);
+    }
+    else if (rec->type == XREC_KEY)
+    {
+        printf("%s", rec->text);
+        if (log_binary)
+            write_binary_record(ls, rec);
+        else
+            log_writer_append(&ls->lw, rec->text, strlen(rec->text));
+    }
+    else if (rec->type == XREC_TIMING)
+    {
+        // Only emitted for binary logs
+        write_binary_timing(ls, rec);
+    }
+}
+
+/*
+ * XREC_EPOCH: every intern id from here on is of the new
+ * generation, so forget the old ones and let the X
+ * thread have their generation back.
+ */
+static void names_epoch_passed(uint32_t epoch)
+{
+    for (int i = 0; i < nstreams; i++)
+    {
+        struct log_stream *ls = &streams[i];
+        if (ls->name_map)
+            memset(ls->name_map, 0, ls->name_map_cap * sizeof(*ls->name_map));
+        if (ls->agg)
+            agg_epoch(ls->agg);
+    }
+    atomic_store_explicit(&names_passed, epoch, memory_order_release);
+}
+
+static void *writer_thread(void *arg)
+{
+    struct spsc_ring *r = arg;
+
+    for (;;)
+    {
+        size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+        if (tail != head)
+        {
+            while (tail != head)
+            {
+                const struct xrec *rec = &r->slots[tail & (RING_SIZE - 1)];
+                if (rec->type == XREC_EPOCH)
+                {
+                    names_epoch_passed(rec->name_id);
+                }
+                else
+                {
+                    write_record(rec);
+                    log_writer_mark(&streams[rec->stream].lw, rec->enq_ns);
+                    log_writer_record_done(&streams[rec->stream].lw);
+                }
+                tail++;
+                atomic_store_explicit(&r->tail, tail, memory_order_release);
+            }
+            fflush(stdout);
+            agg_tick();
+            for (int i = 0; i < nstreams; i++)
+                log_stream_tick(&streams[i]);
+            continue;
+        }
+
+        if (atomic_load(&r->stop))
+            break;
+
+        // Announce that we are about to sleep, then re-check so a
+        // push racing with us is not missed.
+        atomic_store(&r->consumer_sleeping, 1);
+        if (atomic_load(&r->head) != tail || atomic_load(&r->stop))
+        {
+            atomic_store(&r->consumer_sleeping, 0);
+            continue;
+        }
+
+        int timeout = agg_timeout();
+        for (int i = 0; i < nstreams; i++)
+        {
+            int t = log_stream_timeout(&streams[i]);
+            if (t >= 0 && (timeout < 0 || t < timeout))
+                timeout = t;
+        }
+
+        struct pollfd pfd = {.fd = r->wake_fd, .events = POLLIN};
+        int ready = poll(&pfd, 1, timeout);
+        atomic_store(&r->consumer_sleeping, 0);
+        if (ready > 0)
+        {
+            uint64_t cnt;
+            if (read(r->wake_fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+                perror("eventfd read");
+        }
+        agg_tick();
+        for (int i = 0; i < nstreams; i++)
+            log_stream_tick(&streams[i]);
+    }
+
+    // The interval cut short by exiting
+    for (int i = 0; i < nstreams; i++)
+        agg_flush(&streams[i], agg_start_ns, monotonic_ns());
+    for (int i = 0; i < nstreams; i++)
+        log_stream_close(&streams[i]);
+    fflush(stdout);
+    return NULL;
+}
+
+void ring_stop(struct spsc_ring *r)
+{
+    atomic_store(&r->stop, 1);
+    atomic_store(&r->consumer_sleeping, 0);
+
+    uint64_t one = 1;
+    if (write(r->wake_fd, &one, sizeof(one)) < 0)
+        perror("eventfd write");
+}
+
+/* --------------------------------------------------
+ * Intake: turn an event into a ring record. These run
+ * on the X thread and never touch the log.
+ * -------------------------------------------------- */
+void emit_focus(Window w)
+{
+    uint32_t name_id = name_cache_get_id(w);
+    const char *wname = name_str(name_id);
+    if (!wname || !*wname)
+        return;
+
+    struct xrec *rec = ring_reserve(&ring);
+    if (rec)
+    {
+        rec->type = XREC_FOCUS;
+        rec->keycode = 0;
+        rec->state = 0;
+        rec->keysym = NoSymbol;
+        rec->ts_ns = monotonic_ns(); // FocusIn has no server time
+        rec->window = w;
+        rec->name_id = name_id;
+        rec->text[0] = '\0';
+        rec->stream = cur_stream;
+        rec->enq_ns = monotonic_ns();
+        ring_push(&ring);
+        counter_add(&stats.focus, 1);
+    }
+}
+
+void emit_key(XEvent *ev)
+{
+    KeySym keysym;
+    const char *ks;
+    struct xrec *rec;
+    uint64_t t0 = monotonic_ns();
+
+#ifdef XKEY_XKBCOMMON
+    if (xkbc_enabled)
+        ks = xkbc_lookup(ev, &keysym);
+    else
+#endif
+        ks = key_table_lookup(ev, &keysym);
+    hist_add(&stats.translate, monotonic_ns() - t0);
+
+    if (ks && (rec = ring_reserve(&ring)))
+    {
+        rec->type = XREC_KEY;
+        rec->keycode = (uint8_t)ev->xkey.keycode;
+        rec->state = (uint16_t)ev->xkey.state;
+        rec->keysym = (uint32_t)keysym;
+        rec->ts_ns = server_time_ns(ev->xkey.time);
+        rec->window = ev->xkey.window;
+        snprintf(rec->text, sizeof(rec->text), "%s", ks);
+        rec->stream = cur_stream;
+        rec->enq_ns = monotonic_ns();
+        hist_add(&stats.x_to_enqueue, rec->enq_ns - rec->ts_ns);
+        ring_push(&ring);
+        counter_add(&stats.keys, 1);
+    }
+}
+
+/* --------------------------------------------------
+ * Key timing (--timing).
+ *
+ * With KeyRelease also captured, a fixed array indexed
+ * by keycode holds the press of every key that is down,
+ * so the event path never allocates. Each release gives
+ * the key's dwell, and its flight (see xkeylog.h). The
+ * flight is known at the press if the key before it is
+ * already up, or else when that key comes up.
+ *
+ * A press of a key that is down is an autorepeat. With
+ * XKB detectable autorepeat the server sends no release
+ * in between; without it, a release followed by a press
+ * of the same key at the same server time is one. A key
+ * whose release was lost (focus moved to a window we do
+ * not select on) is taken as pressed anew once it has
+ * been quiet for longer than any repeat interval.
+ *
+ * Timings go to the stats histograms and, for binary
+ * logs, into XKEYLOG_TIMING records.
+ * -------------------------------------------------- */
+#define KEY_REPEAT_GAP_NS 1500000000ull
+
+struct key_down
+{
+    uint64_t press_ns;   // 0 = up
+    uint64_t seen_ns;    // last press or repeat
+    uint64_t release_ns; // last release
+    int64_t flight_ns;   // INT64_MIN = not known (yet)
+    int16_t waiter;      // key whose flight ends at our release, -1 = none
+};
+
+// Per display, allocated by key_timing_setup()
+struct key_timing_state
+{
+    int detectable_repeat;
+    int last_pressed; // -1 = none yet
+    struct key_down keys[256];
+};
+
+static int key_timing = 0;
+static struct key_timing_state *kts = NULL;
+
+void key_timing_setup(void)
+{
+    kts = malloc(sizeof(*kts));
+    if (kts == NULL)
+    {
+        perror("malloc");
+        exit(1);
+    }
+    memset(kts, 0, sizeof(*kts));
+
+    Bool supported = False;
+    XkbSetDetectableAutoRepeat(d, True, &supported);
+    kts->detectable_repeat = supported == True;
+    for (int i = 0; i < 256; i++)
+        kts->keys[i].waiter = -1;
+    kts->last_pressed = -1;
+}
+
+void key_timing_press(unsigned int keycode, uint64_t ts_ns)
+{
+    struct key_down *k = &kts->keys[keycode & 0xff];
+
+    if (k->press_ns && ts_ns - k->seen_ns < KEY_REPEAT_GAP_NS)
+    {
+        k->seen_ns = ts_ns;
+        counter_add(&stats.repeats, 1);
+        return;
+    }
+
+    k->flight_ns = INT64_MIN;
+    if (kts->last_pressed >= 0)
+    {
+        struct key_down *prev = &kts->keys[kts->last_pressed];
+        if (!prev->press_ns && prev->release_ns)
+            k->flight_ns = (int64_t)(ts_ns - prev->release_ns);
+        else if (prev != k)
+            prev->waiter = (int16_t)(keycode & 0xff);
+    }
+    k->press_ns = k->seen_ns = ts_ns ? ts_ns : 1;
+    kts->last_pressed = (int)(keycode & 0xff);
+}
+
+static void emit_timing(unsigned int keycode, uint64_t ts_ns, uint64_t dwell_ns, int64_t flight_ns)
+{
+    struct xrec *rec = ring_reserve(&ring);
+    if (!rec)
+        return;
+
+    rec->type = XREC_TIMING;
+    rec->keycode = (uint8_t)keycode;
+    rec->state = 0;
+    rec->keysym = NoSymbol;
+    rec->ts_ns = ts_ns;
+    rec->window = None;
+    rec->text[0] = '\0';
+    rec->dwell_us = dwell_ns / 1000 > UINT32_MAX ? UINT32_MAX : (uint32_t)(dwell_ns / 1000);
+    if (flight_ns == INT64_MIN || flight_ns / 1000 > INT32_MAX || flight_ns / 1000 <= INT32_MIN)
+        rec->flight_us = XKEYLOG_NO_FLIGHT;
+    else
+        rec->flight_us = (int32_t)(flight_ns / 1000);
+    rec->stream = cur_stream;
+    rec->enq_ns = monotonic_ns();
+    ring_push(&ring);
+}
+
+void key_timing_release(unsigned int keycode, uint64_t ts_ns)
+{
+    struct key_down *k = &kts->keys[keycode & 0xff];
+    if (!k->press_ns)
+        return; // pressed before we started, or in a window we skip
+
+    // The key pressed while we were held gets a negative flight
+    if (k->waiter >= 0)
+    {
+        struct key_down *w = &kts->keys[k->waiter];
+        if (w->press_ns && w->flight_ns == INT64_MIN)
+            w->flight_ns = (int64_t)(w->press_ns - ts_ns);
+        k->waiter = -1;
+    }
+
+    uint64_t dwell = ts_ns > k->press_ns ? ts_ns - k->press_ns : 0;
+    hist_add(&stats.dwell, dwell);
+    if (k->flight_ns != INT64_MIN)
+    {
+        if (k->flight_ns >= 0)
+            hist_add(&stats.flight, (uint64_t)k->flight_ns);
+        else
+            hist_add(&stats.overlap, (uint64_t)-k->flight_ns);
+    }
+    if (log_binary)
+        emit_timing(keycode, ts_ns, dwell, k->flight_ns);
+
+    k->press_ns = 0;
+    k->release_ns = ts_ns ? ts_ns : 1;
+}
+
+/*
+ * Without detectable autorepeat: whether the release is
+ * half of a repeat, i.e. the same key is pressed again
+ * at the same time by the next event. The press is sent
+ * right behind the release but may not have been read
+ * off the socket yet.
+ */
+int key_release_is_repeat(XEvent *ev)
+{
+    XEvent next;
+
+    if (kts->detectable_repeat || !XEventsQueued(d, QueuedAfterReading))
+        return 0;
+    XPeekEvent(d, &next);
+    return next.type == KeyPress && next.xkey.keycode == ev->xkey.keycode &&
+           next.xkey.time == ev->xkey.time;
+}
+
+/* --------------------------------------------------
+ * FocusIn coalescing (--coalesce-ms, --skip-frames).
+ *
+ * A reparenting WM turns one focus change into a burst
+ * of FocusIn on the frame, the client, the frame ...
+ * focus_intake() holds the latest one back until no
+ * other FocusIn has arrived for `coalesce_ms', so only
+ * the final window is named and logged. With
+ * `skip_frames', windows without WM_STATE are never
+ * logged at all. Both count as suppressed. A FocusIn on
+ * a frame is taken for its client (window_client()).
+ * -------------------------------------------------- */
+static long coalesce_ms = 0;
+static int skip_frames = 0;
+static Window pending_focus = None;
+static uint64_t pending_deadline_ns;
+static unsigned long focus_suppressed = 0;
+
+/*
+ * Log the held-back FocusIn now. Called before any key
+ * so records stay in order.
+ */
+void focus_flush(void)
+{
+    if (pending_focus != None)
+    {
+        emit_focus(pending_focus);
+        pending_focus = None;
+    }
+}
+
+void focus_intake(Window w)
+{
+    Window frame = w;
+
+    w = window_client(w);
+    if (skip_frames && !window_is_client(w))
+    {
+        focus_suppressed++;
+        return;
+    }
+    // The frame was selected for its own name; the client must match too
+    if (w != frame && track_matched_only && !window_set_has(&matched, w) &&
+        !nameMatchesDesignated(name_cache_get(w), track_designated))
+    {
+        focus_suppressed++;
+        return;
+    }
+
+    if (coalesce_ms <= 0)
+    {
+        emit_focus(w);
+        return;
+    }
+
+    if (pending_focus != None)
+        focus_suppressed++;
+    pending_focus = w;
+    pending_deadline_ns = monotonic_ns() + (uint64_t)coalesce_ms * 1000000ull;
+}
+
+/*
+ * Poll timeout until the held-back FocusIn is due.
+ */
+int focus_timeout(void)
+{
+    if (pending_focus == None)
+        return -1;
+
+    uint64_t now = monotonic_ns();
+    if (now >= pending_deadline_ns)
+        return 0;
+    return (int)((pending_deadline_ns - now + 999999) / 1000000);
+}
+
+void focus_tick(void)
+{
+    if (pending_focus != None && monotonic_ns() >= pending_deadline_ns)
+        focus_flush();
+}
+
+#ifdef XKEY_XI2
+/* --------------------------------------------------
+ * XInput2 raw-key backend (--xi2).
+ *
+ * Instead of selecting input on every window, select
+ * XI_RawKeyPress / XI_RawKeyRelease once on the root
+ * and attribute keys to _NET_ACTIVE_WINDOW, which is
+ * watched through PropertyNotify on the root. Setup
+ * and per-event cost do not depend on the number of
+ * windows. Raw events carry no modifier state, so it
+ * is tracked from XkbStateNotify. The designated name
+ * becomes a post-filter on the active window.
+ *
+ * Without an EWMH window manager there is no property
+ * to watch, and focus changes between top-levels are
+ * not reported on the root, so the X input focus is
+ * read again for every key press instead.
+ * -------------------------------------------------- */
+static int xi2_enabled = 0;
+
+// Per display (struct xdisplay), handed to every function below
+struct xi2_display
+{
+    int opcode; // XInput extension
+    int xkb_event_base;
+    unsigned int xkb_core_state;
+    Window active_window;
+    int active_passes;
+    int active_from_ewmh;  // _NET_ACTIVE_WINDOW is kept on the root
+    long active_prev_mask; // ours on active_window before it was
+    const struct matcher *designated;
+};
+
+static Window read_active_window(struct xi2_display *xs)
+{
+    Window root = DefaultRootWindow(d), w = None;
+    Atom type;
+    int format;
+    unsigned long nitems, after;
+    unsigned char *prop = NULL;
+
+    if (XGetWindowProperty(d, root, atoms[ATOM__NET_ACTIVE_WINDOW], 0, 1, False,
+                           XA_WINDOW, &type, &format, &nitems, &after, &prop) == Success &&
+        prop)
+    {
+        if (type == XA_WINDOW && format == 32 && nitems == 1)
+            w = *(Window *)prop;
+        XFree(prop);
+    }
+    xs->active_from_ewmh = type == XA_WINDOW;
+
+    // Not an EWMH window manager: fall back to the X input focus
+    if (w == None)
+    {
+        int revert;
+        XGetInputFocus(d, &w, &revert);
+    }
+    // The root (e.g. reverted to from a destroyed window) has no keys of its own
+    return w == PointerRoot || w == root ? None : w;
+}
+
+void xi2_update_active(struct xi2_display *xs)
+{
+    Window w = window_client(read_active_window(xs));
+    if (w == xs->active_window)
+        return;
+
+    // Give the old window back the events it had before; its
+    // name is no longer kept current unless those include it
+    if (xs->active_window != None)
+    {
+        XSelectInput(d, xs->active_window, xs->active_prev_mask);
+        if (!(xs->active_prev_mask & PropertyChangeMask))
+            name_cache_forget(xs->active_window);
+    }
+
+    xs->active_window = w;
+    if (w == None)
+    {
+        xs->active_passes = !xs->designated;
+        return;
+    }
+
+    // Keep the cached name of the active window current
+    XWindowAttributes wa;
+    xs->active_prev_mask = XGetWindowAttributes(d, w, &wa) ? wa.your_event_mask : NoEventMask;
+    XSelectInput(d, w, xs->active_prev_mask | PropertyChangeMask | StructureNotifyMask);
+
+    xs->active_passes = !xs->designated ||
+                        nameMatchesDesignated(name_cache_get(w), xs->designated);
+    if (xs->active_passes)
+        focus_intake(w);
+}
+
+int xi2_setup(struct xi2_display *xs, const struct matcher *designated)
+{
+    Window root = DefaultRootWindow(d);
+    int event, error;
+
+    *xs = (struct xi2_display){.opcode = -1, .xkb_event_base = -1, .active_passes = 1};
+    if (!XQueryExtension(d, "XInputExtension", &xs->opcode, &event, &error))
+    {
+        fprintf(stderr, "X server has no XInput extension\n");
+        return 0;
+    }
+
+    // Before 2.2, raw events stop while another client has a grab
+    int major = 2, minor = 2;
+    if (XIQueryVersion(d, &major, &minor) != Success || major < 2 || (major == 2 && minor < 2))
+    {
+        fprintf(stderr, "X server does not support XI 2.2\n");
+        return 0;
+    }
+
+    unsigned char bits[XIMaskLen(XI_LASTEVENT)] = {0};
+    XIEventMask mask = {.deviceid = XIAllMasterDevices, .mask_len = sizeof(bits), .mask = bits};
+    XISetMask(bits, XI_RawKeyPress);
+    XISetMask(bits, XI_RawKeyRelease);
+    XISelectEvents(d, root, &mask, 1);
+
+    int xkb_opcode, xkb_major = XkbMajorVersion, xkb_minor = XkbMinorVersion;
+    if (XkbQueryExtension(d, &xkb_opcode, &xs->xkb_event_base, &error, &xkb_major, &xkb_minor))
+    {
+        XkbStateRec st;
+        XkbSelectEventDetails(d, XkbUseCoreKbd, XkbStateNotify,
+                              XkbAllStateComponentsMask, XkbAllStateComponentsMask);
+        if (XkbGetState(d, XkbUseCoreKbd, &st) == Success)
+            xs->xkb_core_state = XkbBuildCoreState(st.lookup_mods, st.group);
+    }
+
+    XSelectInput(d, root, PropertyChangeMask);
+    xs->designated = designated;
+    xi2_update_active(xs);
+    return 1;
+}
+
+void xi2_set_designated(struct xi2_display *xs, const struct matcher *designated)
+{
+    xs->designated = designated;
+    xs->active_passes = !xs->designated ||
+                        nameMatchesDesignated(name_cache_get(xs->active_window), xs->designated);
+}
+
+/*
+ * Returns 1 if `ev' belonged to the XI2 backend.
+ */
+int xi2_handle_event(struct xi2_display *xs, XEvent *ev)
+{
+    if (ev->type == xs->xkb_event_base && xs->xkb_event_base >= 0)
+    {
+        XkbEvent *xkb = (XkbEvent *)ev;
+        if (xkb->any.xkb_type == XkbStateNotify)
+            xs->xkb_core_state = XkbBuildCoreState(xkb->state.lookup_mods, xkb->state.group);
+        return 1;
+    }
+
+    if (ev->type == PropertyNotify &&
+        ev->xproperty.window == DefaultRootWindow(d) &&
+        ev->xproperty.atom == atoms[ATOM__NET_ACTIVE_WINDOW])
+    {
+        xi2_update_active(xs);
+        return 1;
+    }
+
+    // The active window was renamed: re-run the post-filter
+    if (ev->type == PropertyNotify && ev->xproperty.window == xs->active_window &&
+        (ev->xproperty.atom == atoms[ATOM__NET_WM_NAME] || ev->xproperty.atom == XA_WM_NAME))
+    {
+        name_cache_invalidate(xs->active_window);
+        xs->active_passes = !xs->designated ||
+                            nameMatchesDesignated(name_cache_get(xs->active_window), xs->designated);
+        return 1;
+    }
+
+    XGenericEventCookie *cookie = &ev->xcookie;
+    if (ev->type != GenericEvent || cookie->extension != xs->opcode ||
+        !XGetEventData(d, cookie))
+        return 0;
 
-Display *d;
+    if (cookie->evtype == XI_RawKeyPress && !xs->active_from_ewmh)
+        xi2_update_active(xs);
 
-/* --------------------------------------------------
- * A small utility to safely get the local time
- * as a string (YYYY-mm-dd HH:MM:SS).
- * -------------------------------------------------- */
-void getTimeStr(char *buf, size_t buflen)
-{
-    time_t current_time = time(NULL);
-    if (current_time == (time_t)-1)
+    if (cookie->evtype == XI_RawKeyPress && xs->active_passes)
     {
-        perror("time");
-        snprintf(buf, buflen, "UnknownTime");
-        return;
-    }
+        XIRawEvent *raw = cookie->data;
+        XEvent kev;
 
-    struct tm *local_time = localtime(&current_time);
-    if (!local_time)
+        // Synthesize the core event TranslateKeyCode() expects
+        memset(&kev, 0, sizeof(kev));
+        kev.xkey.type = KeyPress;
+        kev.xkey.display = d;
+        kev.xkey.window = xs->active_window;
+        kev.xkey.root = DefaultRootWindow(d);
+        kev.xkey.time = raw->time;
+        kev.xkey.keycode = (unsigned int)raw->detail;
+        kev.xkey.state = xs->xkb_core_state;
+        kev.xkey.same_screen = True;
+        focus_flush();
+        if (key_timing)
+            key_timing_press(kev.xkey.keycode, server_time_ns(raw->time));
+        emit_key(&kev);
+    }
+    else if (cookie->evtype == XI_RawKeyRelease && key_timing)
     {
-        snprintf(buf, buflen, "UnknownTime");
-        return;
+        // Also outside captured windows, so no key is left down
+        XIRawEvent *raw = cookie->data;
+        key_timing_release((unsigned int)raw->detail, server_time_ns(raw->time));
     }
 
-    strftime(buf, buflen, "%Y-%m-%d %H:%M:%S", local_time);
+    XFreeEventData(d, cookie);
+    return 1;
 }
 
+#endif /* XKEY_XI2 */
+
 /* --------------------------------------------------
- * Helper function to retrieve a window's name.
- *  - Tries _NET_WM_NAME first (UTF-8)
- *  - Falls back to XFetchName (old WM_NAME)
+ * Displays.
  *
- * Returns a newly allocated string, or NULL if none.
- * The caller is responsible for XFree() or free() of
- * the returned pointer, depending on which path is used.
+ * One xkey can capture several displays (one argument
+ * each) from this thread. The per-connection state
+ * above (atoms, server clock, name cache, matched set,
+ * key table, pending FocusIn, XKB state) lives in
+ * globals the code uses directly. Each display keeps
+ * its copy in struct xdisplay, and display_switch()
+ * swaps it in before anything is done on that
+ * connection, once per batch. A global missing from
+ * XDISPLAY_STATE is silently shared, so newer state is
+ * kept in a struct of its own instead (struct
+ * xi2_display), which its functions are handed.
  * -------------------------------------------------- */
-char *getWindowName(Display *disp, Window w)
+#define MAX_DISPLAYS 64
+
+#ifdef XKEY_XKBCOMMON
+#define XDISPLAY_XKBC_STATE(F) \
+    F(xkbc_event_base) F(xkbc_conn) F(xkbc_ctx) F(xkbc_core) F(xkbc_cache) F(xkbc_clock)
+#else
+#define XDISPLAY_XKBC_STATE(F)
+#endif
+
+#define XDISPLAY_STATE(F)                                                               \
+    F(d) F(cur_stream) F(atoms)                                                         \
+    F(server_offset_ns) F(server_anchored) F(server_last_ms) F(server_wraps)            \
+    F(name_slots) F(name_cap) F(name_count)                                             \
+    F(matched) F(track_matched_only) F(track_designated)                                \
+    F(kt_min_keycode) F(kt_max_keycode) F(kt_entries) F(kt_pool) F(kt_pool_len)         \
+    F(kt_pool_cap) F(kt_dedup) F(kt_dedup_cap)                                          \
+    F(pending_focus) F(pending_deadline_ns)                                             \
+    F(kts)                                                                              \
+    XDISPLAY_XKBC_STATE(F)
+
+#define XDISPLAY_DECL(f) __typeof__(f) f;
+#define XDISPLAY_SAVE(f) memcpy(&cur_display->f, &f, sizeof(f));
+#define XDISPLAY_LOAD(f) memcpy(&f, &x->f, sizeof(f));
+
+struct xdisplay
 {
-    Atom netWmName = XInternAtom(disp, "_NET_WM_NAME", False);
-    Atom actualType;
-    int actualFormat;
-    unsigned long nitems, bytesAfter;
-    unsigned char *prop = NULL;
+    const char *name;
+    XDISPLAY_STATE(XDISPLAY_DECL)
+#ifdef XKEY_XI2
+    struct xi2_display xi2;
+#endif
+};
 
-    // 1) Try _NET_WM_NAME
-    if (XGetWindowProperty(disp, w, netWmName,
-                           0, (~0L),
-                           False, AnyPropertyType,
-                           &actualType, &actualFormat,
-                           &nitems, &bytesAfter,
-                           &prop) == Success &&
-        prop)
+static struct xdisplay displays[MAX_DISPLAYS];
+static int ndisplays = 0;
+static struct xdisplay *cur_display = NULL;
+static struct xdisplay display_initial; // the globals before any display
+
+void display_switch(struct xdisplay *x)
+{
+    if (x == cur_display)
+        return;
+    if (cur_display)
     {
-        // It's often UTF-8 text
-        char *name_utf8 = strdup((char *)prop);
-        XFree(prop);
-        return name_utf8;
+        XDISPLAY_STATE(XDISPLAY_SAVE)
     }
+    XDISPLAY_STATE(XDISPLAY_LOAD)
+    cur_display = x;
+}
 
-    // 2) Fall back to XFetchName (old WM_NAME)
-    char *name_legacy = NULL;
-    if (XFetchName(disp, w, &name_legacy) && name_legacy)
+/*
+ * Open `name' and make it the current display, with
+ * state as it was before any display was set up.
+ */
+struct xdisplay *display_open(const char *name)
+{
+    if (ndisplays == MAX_DISPLAYS)
     {
-        // name_legacy is allocated by XFetchName, must XFree it eventually
-        return name_legacy; // we'll return it directly
+        fprintf(stderr, "Too many displays (max %d)\n", MAX_DISPLAYS);
+        exit(1);
     }
 
-    return NULL;
+    struct xdisplay *x = &displays[ndisplays];
+    if (ndisplays == 0)
+    {
+        struct xdisplay *saved = cur_display;
+        cur_display = &display_initial;
+        XDISPLAY_STATE(XDISPLAY_SAVE)
+        cur_display = saved;
+    }
+    *x = display_initial;
+    x->name = name;
+    x->cur_stream = (uint8_t)ndisplays;
+    x->d = XOpenDisplay(name);
+    if (x->d == NULL)
+    {
+        fprintf(stderr, "Cannot open display: %s\n", name);
+        exit(10);
+    }
+    ndisplays++;
+    display_switch(x);
+    return x;
 }
 
-/* --------------------------------------------------
- * We’ll use this function to decide if a window name
- * "matches" the designated string (by substring check).
- * -------------------------------------------------- */
-int nameMatchesDesignated(char *wname, const char *designated)
+/*
+ * Between batches: once the current generation of
+ * titles is full and the writer has given back the
+ * other one, move every display's name cache over and
+ * tell the writer (see the intern table).
+ */
+void names_collect(void)
 {
-    if (!wname || !*wname)
-        return 0;
-    if (!designated || !*designated)
-        return 0;
+    if (!names_full() || atomic_load_explicit(&names_passed, memory_order_acquire) != names_epoch)
+        return;
+
+    struct xrec *rec = ring_reserve(&ring);
+    if (!rec)
+        return; // next time
 
-    // Substring match. If you want exact match, use strcmp(wname, designated) == 0
-    return (strstr(wname, designated) != NULL);
+    names_begin(names_epoch + 1);
+    memset(rec, 0, sizeof(*rec));
+    rec->type = XREC_EPOCH;
+    rec->name_id = names_epoch;
+    rec->ts_ns = rec->enq_ns = monotonic_ns();
+    ring_push(&ring);
+    counter_add(&stats.name_epochs, 1);
+
+    struct xdisplay *saved = cur_display;
+    for (int i = 0; i < ndisplays; i++)
+    {
+        display_switch(&displays[i]);
+        name_cache_renew();
+    }
+    display_switch(saved);
 }
 
 /* --------------------------------------------------
- * We'll store *all* top-level windows that match the
- * designated name in a global or static array.
+ * config.txt hot reload (--watch-config).
+ *
+ * The directory is watched rather than the file, so
+ * editors that save by renaming a new file over it
+ * (or delete and recreate it) are seen too.
  * -------------------------------------------------- */
-static Window *matched_windows = NULL;
-static int matched_count = 0;
+#define CONFIG_PATH "config.txt"
+
+static struct matcher *config_patterns = NULL;
+static int config_watch_fd = -1;
+
+void config_watch_init(void)
+{
+    config_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (config_watch_fd < 0)
+    {
+        perror("inotify_init1");
+        exit(1);
+    }
+    if (inotify_add_watch(config_watch_fd, ".",
+                          IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0)
+    {
+        perror("inotify_add_watch");
+        exit(1);
+    }
+}
+
+static void config_reload(void)
+{
+    struct matcher *old = config_patterns;
+
+    config_patterns = config_load(CONFIG_PATH);
+    for (int i = 0; i < ndisplays; i++)
+    {
+        display_switch(&displays[i]);
+#ifdef XKEY_XI2
+        if (xi2_enabled)
+            xi2_set_designated(&cur_display->xi2, config_patterns);
+        else
+#endif
+            reselect_windows(config_patterns);
+    }
+    matcher_free(old);
+}
 
 /*
- * Recursively query children of "root" for top-level windows,
- * check if name matches "designated". If so, store them in
- * a dynamic array matched_windows[].
+ * Drain pending inotify events; reload once if any of
+ * them was about config.txt.
  */
-void find_matched_windows(Window root, const char *designated)
+void config_watch_check(void)
 {
-    Window parent, *children;
-    unsigned int nchildren;
-    if (!XQueryTree(d, root, &root, &parent, &children, &nchildren) || nchildren == 0)
-    {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+    ssize_t n;
+
+    if (config_watch_fd < 0)
         return;
-    }
 
-    for (unsigned int i = 0; i < nchildren; i++)
+    while ((n = read(config_watch_fd, buf, sizeof(buf))) > 0)
     {
-        // For each child, attempt to get the window name
-        char *wname = getWindowName(d, children[i]);
-        if (wname)
+        for (char *p = buf; p < buf + n;)
         {
-            if (nameMatchesDesignated(wname, designated))
-            {
-                matched_count++;
-                matched_windows = realloc(matched_windows, matched_count * sizeof(Window));
-                matched_windows[matched_count - 1] = children[i];
-            }
-            XFree(wname); // or free(wname) depending on which call allocated it
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (ev->len && strcmp(ev->name, CONFIG_PATH) == 0)
+                changed = 1;
+            p += sizeof(*ev) + ev->len;
         }
-
-        // Recursively look for deeper children
-        find_matched_windows(children[i], designated);
     }
+    if (n < 0 && errno != EAGAIN && errno != EINTR)
+        perror("inotify read");
 
-    if (children)
-    {
-        XFree(children);
-    }
+    if (changed)
+        config_reload();
 }
 
 /* --------------------------------------------------
- * We want to do one pass:
- *   - find all windows matching designated name
- *   - If found => only select KeyPressMask/FocusChangeMask on them
- *   - If none found => select KeyPressMask/FocusChangeMask on *all* windows
+ * Per-event dispatch, called for every event of a
+ * batch. Records are only staged here.
  * -------------------------------------------------- */
-void snoop_windows(const char *designated, int *foundAnyMatches)
+static unsigned long batch_count = 0, batch_events = 0, batch_max = 0;
+
+static void batch_stat(int n)
 {
-    Window root = DefaultRootWindow(d);
+    if (n <= 0)
+        return;
+    batch_count++;
+    batch_events += (unsigned long)n;
+    if ((unsigned long)n > batch_max)
+        batch_max = (unsigned long)n;
+}
 
-    // 1) Gather all windows that match "designated"
-    find_matched_windows(root, designated);
+void handle_event(XEvent *xev)
+{
+    counter_add(&stats.events, 1);
 
-    if (matched_count > 0)
-    {
-        // We found at least one matching window
-        *foundAnyMatches = 1;
+#ifdef XKEY_XKBCOMMON
+    if (xkbc_enabled)
+        xkbc_observe_event(xev);
+#endif
+#ifdef XKEY_XI2
+    if (xi2_enabled && xi2_handle_event(&cur_display->xi2, xev))
+        return;
+#endif
 
-        // Select KeyPressMask + FocusChangeMask only on matched windows
-        for (int i = 0; i < matched_count; i++)
-        {
-            XSelectInput(d, matched_windows[i], KeyPressMask | FocusChangeMask);
-        }
+    if (xev->type == FocusIn)
+    {
+        // Window gained focus
+        XFocusChangeEvent *fc = (XFocusChangeEvent *)xev;
+        focus_intake(fc->window);
     }
-    else
+    else if (xev->type == PropertyNotify)
     {
-        // No match => catch them all (like the original code)
-        *foundAnyMatches = 0;
-
-        // Just do a recursion that selects input on every child window
-        // same approach as original "snoop_all_windows", but no double
-        // select on the root if that caused duplicates.
-        Window parent, *children;
-        unsigned int nchildren;
-
-        if (XQueryTree(d, root, &root, &parent, &children, &nchildren) && (nchildren > 0))
+        // Title changed: refetch on the next FocusIn
+        Atom a = xev->xproperty.atom;
+        if (a == atoms[ATOM__NET_WM_NAME] || a == XA_WM_NAME)
+        {
+            name_cache_invalidate(xev->xproperty.window);
+            track_check_window(xev->xproperty.window);
+        }
+        else if (a == atoms[ATOM_WM_STATE])
         {
-            for (unsigned int i = 0; i < nchildren; i++)
+            struct name_entry *e = name_cache_find(xev->xproperty.window);
+            if (e)
             {
-                XSelectInput(d, children[i], KeyPressMask | FocusChangeMask);
-
-                // Then recursively select on sub-children
-                // a small helper function:
-                void recursive_select(Window w)
-                {
-                    Window par, *ch;
-                    unsigned int nch;
-                    if (!XQueryTree(d, w, &w, &par, &ch, &nch) || nch == 0)
-                        return;
-                    for (unsigned int k = 0; k < nch; k++)
-                    {
-                        XSelectInput(d, ch[k], KeyPressMask | FocusChangeMask);
-                        recursive_select(ch[k]);
-                    }
-                    XFree(ch);
-                }
-                recursive_select(children[i]);
+                e->wm_state = -1;
+                window_client_reset(e->parent);
             }
-            XFree(children);
         }
     }
+    else if (xev->type == CreateNotify)
+    {
+        window_set_parent(xev->xcreatewindow.window, xev->xcreatewindow.parent);
+        track_new_window(xev->xcreatewindow.window);
+    }
+    else if (xev->type == ReparentNotify)
+    {
+        window_set_parent(xev->xreparent.window, xev->xreparent.parent);
+        track_new_window(xev->xreparent.window);
+    }
+    else if (xev->type == MapNotify)
+    {
+        track_check_window(xev->xmap.window);
+    }
+    else if (xev->type == DestroyNotify)
+    {
+        track_forget_window(xev->xdestroywindow.window);
+    }
+    else if (xev->type == KeyPress)
+    {
+        // Key pressed
+        focus_flush();
+        if (key_timing)
+            key_timing_press(xev->xkey.keycode, server_time_ns(xev->xkey.time));
+        emit_key(xev);
+    }
+    else if (xev->type == KeyRelease)
+    {
+        if (key_timing && !key_release_is_repeat(xev))
+            key_timing_release(xev->xkey.keycode, server_time_ns(xev->xkey.time));
+    }
+    else if (xev->type == MappingNotify)
+    {
+        key_table_refresh(&xev->xmapping);
+    }
 }
 
 /* --------------------------------------------------
- * Translate a KeyPress event into a readable string.
+ * Stats dump: on SIGUSR1, every --stats-interval
+ * seconds (a timerfd in the event loop) and at exit,
+ * to --stats-file (appended) or stderr.
  * -------------------------------------------------- */
-#define KEY_BUFF_SIZE 256
-static char key_buff[KEY_BUFF_SIZE];
+static const char *stats_path = NULL;
+static long stats_interval = 0; // seconds, 0 = only on SIGUSR1
 
-char *TranslateKeyCode(XEvent *ev)
+static void stats_dump_hist(FILE *f, const char *label, struct hist *h)
 {
-    KeySym ks;
-    XKeyEvent *xk = (XKeyEvent *)ev;
-    int count = XLookupString(xk, key_buff, KEY_BUFF_SIZE, &ks, NULL);
-    key_buff[count] = '\0';
+    uint64_t n = atomic_load_explicit(&h->total, memory_order_relaxed);
+    if (n == 0)
+    {
+        fprintf(f, "  %-18s n=0\n", label);
+        return;
+    }
+    fprintf(f, "  %-18s n=%llu p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n", label,
+            (unsigned long long)n,
+            hist_percentile(h, 0.50) / 1e3, hist_percentile(h, 0.99) / 1e3,
+            hist_percentile(h, 0.999) / 1e3,
+            atomic_load_explicit(&h->max, memory_order_relaxed) / 1e3);
+}
 
-    // If count == 0, might be special keys (Return, Tab, etc.)
-    if (count == 0)
+static void stats_dump_counter(FILE *f, const char *label, unsigned long long v)
+{
+    fprintf(f, "  %-18s %llu\n", label, v);
+}
+
+#define STAT(c) ((unsigned long long)atomic_load_explicit(&stats.c, memory_order_relaxed))
+
+void stats_dump(void)
+{
+    FILE *f = stderr;
+    if (stats_path && !(f = fopen(stats_path, "a")))
     {
-        char *tmp = XKeysymToString(ks);
-        if (tmp)
-            snprintf(key_buff, KEY_BUFF_SIZE, "<%s>", tmp);
-        else
-            snprintf(key_buff, KEY_BUFF_SIZE, "<UnknownKey>");
+        perror(stats_path);
+        return;
     }
 
-    return key_buff;
+    char now[64];
+    getTimeStr(time(NULL), now, sizeof(now));
+    fprintf(f, "[%s] xkey stats, uptime %.1f s\n", now,
+            (monotonic_ns() - start_ns) / 1e9);
+    stats_dump_counter(f, "startup_scan_us", STAT(scan_us));
+    stats_dump_counter(f, "events", STAT(events));
+    stats_dump_counter(f, "keys", STAT(keys));
+    stats_dump_counter(f, "focus", STAT(focus));
+    stats_dump_counter(f, "focus_suppressed", focus_suppressed);
+    stats_dump_counter(f, "name_cache_hits", STAT(name_hits));
+    stats_dump_counter(f, "name_cache_misses", STAT(name_misses));
+    stats_dump_counter(f, "name_epochs", STAT(name_epochs));
+    stats_dump_counter(f, "name_arena_bytes", names_bytes());
+    stats_dump_counter(f, "batches", batch_count);
+    stats_dump_counter(f, "ring_overflows", ring_overflows(&ring));
+    stats_dump_counter(f, "flushes", STAT(flushes));
+    stats_dump_counter(f, "bytes_written", STAT(bytes_written));
+    stats_dump_counter(f, "segments_rolled", STAT(segments));
+    stats_dump_hist(f, "x_to_enqueue", &stats.x_to_enqueue);
+    stats_dump_hist(f, "translate", &stats.translate);
+    stats_dump_hist(f, "name_lookup", &stats.name_lookup);
+    if (key_timing)
+    {
+        stats_dump_counter(f, "key_repeats", STAT(repeats));
+        stats_dump_hist(f, "key_dwell", &stats.dwell);
+        stats_dump_hist(f, "key_flight", &stats.flight);
+        stats_dump_hist(f, "key_overlap", &stats.overlap);
+    }
+    stats_dump_hist(f, "enqueue_to_write", &stats.enqueue_to_write);
+
+    if (f == stderr)
+        fflush(f);
+    else
+        fclose(f);
 }
 
-void getDesignatedName(char *designated_name)
+#undef STAT
+
+/*
+ * Periodic timer for --stats-interval, or -1 if there
+ * is none.
+ */
+int stats_timer_open(void)
 {
-    FILE *fp = fopen("config.txt", "r");
+    if (stats_interval <= 0)
+        return -1;
 
-    if (!fp)
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct itimerspec its = {
+        .it_interval = {.tv_sec = stats_interval},
+        .it_value = {.tv_sec = stats_interval},
+    };
+    if (fd < 0 || timerfd_settime(fd, 0, &its, NULL) < 0)
     {
-        designated_name = "";
-        return;
+        perror("timerfd");
+        exit(1);
     }
+    return fd;
+}
+
+void stats_timer_fired(int fd)
+{
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+        stats_dump();
+}
+
+/* --------------------------------------------------
+ * Signals arrive on a signalfd in the event loop, not
+ * in handlers, so SIGTERM is handled between batches:
+ * the loop ends, held-back records are published and
+ * the writer drains the ring and flushes every log.
+ * They are blocked before any thread is started so no
+ * thread gets them asynchronously.
+ * -------------------------------------------------- */
+static sigset_t handled_signals;
 
-    if (fgets(designated_name, 256, fp) == NULL)
+void signals_block(void)
+{
+    sigemptyset(&handled_signals);
+    sigaddset(&handled_signals, SIGINT);
+    sigaddset(&handled_signals, SIGTERM);
+    sigaddset(&handled_signals, SIGUSR1);
+    if (pthread_sigmask(SIG_BLOCK, &handled_signals, NULL) != 0)
     {
-        perror("fgets");
+        fprintf(stderr, "Cannot block signals\n");
         exit(1);
     }
+}
 
-    fclose(fp);
+int signals_open(void)
+{
+    int fd = signalfd(-1, &handled_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0)
+    {
+        perror("signalfd");
+        exit(1);
+    }
+    return fd;
+}
+
+void signals_read(int fd)
+{
+    struct signalfd_siginfo si;
+    while (read(fd, &si, sizeof(si)) == sizeof(si))
+    {
+        if (si.ssi_signo == SIGUSR1)
+            stats_dump();
+        else
+            quit_requested = 1;
+    }
+}
+
+// Shorter of two poll() timeouts where -1 means "none"
+static int min_timeout(int a, int b)
+{
+    if (a < 0)
+        return b;
+    if (b < 0)
+        return a;
+    return a < b ? a : b;
 }
 
 /* --------------------------------------------------
  * main()
  * -------------------------------------------------- */
-int main(int argc, char **argv)
+// epoll tags past the display indexes
+enum
+{
+    EP_SIGNAL = MAX_DISPLAYS,
+    EP_STATS,
+    EP_CONFIG,
+    EP_COUNT,
+};
+
+// Add `fd' (if any) to `ep', reported with `tag'
+static void epoll_watch(int ep, int fd, uint32_t tag)
 {
-    char *hostname;
-    if (argc < 1)
+    struct epoll_event ev = {.events = EPOLLIN, .data.u32 = tag};
+    if (fd >= 0 && epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) < 0)
     {
-        fprintf(stderr, "Usage: %s <display>\n", argv[0]);
-        fprintf(stderr, "Example: %s :0 \n", argv[0]);
+        perror("epoll_ctl");
         exit(1);
     }
+}
+
+// "64M" => 64 << 20
+static size_t parse_size(const char *arg)
+{
+    char *end;
+    size_t n = strtoul(arg, &end, 10);
+
+    switch (*end)
+    {
+    case 'G':
+    case 'g':
+        n <<= 10;
+        // fallthrough
+    case 'M':
+    case 'm':
+        n <<= 10;
+        // fallthrough
+    case 'K':
+    case 'k':
+        n <<= 10;
+        break;
+    }
+    return n;
+}
 
-    hostname = argv[1];
-    char *designated_name = malloc(256);
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [options] <display>...\n", prog);
+    fprintf(stderr, "Example: %s :0 \n", prog);
+    fprintf(stderr, "         %s :1 :2 :3   (logs to keylog-1.*, keylog-2.*, keylog-3.*)\n", prog);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --flush-bytes=N   flush keylog.txt once N bytes are buffered (default 4096)\n");
+    fprintf(stderr, "  --flush-ms=T      flush buffered records older than T ms (default 1000, 0 = off)\n");
+    fprintf(stderr, "  --flush-on-focus  flush on every FocusIn\n");
+    fprintf(stderr, "  --track           follow windows created after startup\n");
+    fprintf(stderr, "  --watch-config    reload config.txt when it changes\n");
+    fprintf(stderr, "  --full-scan       select on every window in the tree, not just the _NET_CLIENT_LIST\n"
+                    "                    clients and their subwindows\n");
+    fprintf(stderr, "  --format=FMT      text (keylog.txt, default) or binary (keylog.bin)\n");
+    fprintf(stderr, "  --segment-size=N  write keylog.NNNNNN segments of N bytes (K/M/G suffix ok)\n");
+    fprintf(stderr, "  --segment-time=S  start a new segment every S seconds\n");
+    fprintf(stderr, "  --writer=W        buffered (default) or mmap (needs --segment-size;\n"
+                    "                    --flush-* then control msync, --flush-bytes default 0)\n");
+#ifdef XKEY_URING
+    fprintf(stderr, "  --writer=uring    queue flushes to io_uring without waiting for them\n");
+#endif
+#ifdef XKEY_ZSTD
+    fprintf(stderr, "  --compress[=L]    zstd-compress finished segments in the background (level L, default 3)\n");
+#endif
+    fprintf(stderr, "  --coalesce-ms=T   only log the last of FocusIn events less than T ms apart\n");
+    fprintf(stderr, "  --skip-frames     do not log FocusIn on WM frames (windows without WM_STATE)\n");
+    fprintf(stderr, "  --stats-file=PATH append stats dumps to PATH instead of stderr\n");
+    fprintf(stderr, "  --stats-interval=S  dump stats every S seconds (default: only on SIGUSR1)\n");
+    fprintf(stderr, "  --aggregate[=S]   log a typing summary every S seconds (default 60) instead of keys\n");
+    fprintf(stderr, "  --raw             with --aggregate, log every key as well\n");
+    fprintf(stderr, "  --timing          also capture KeyRelease for key dwell / flight times (stats;\n"
+                    "                    binary logs get a record per release, see xkey-dump --timing)\n");
+    fprintf(stderr, "  --index[=N]       write <log>.idx for xkey-query (a seek point every N records, default 256)\n");
+#ifdef XKEY_XI2
+    fprintf(stderr, "  --xi2             capture raw keys via XInput2 on the root window\n");
+#endif
+#ifdef XKEY_XKBCOMMON
+    fprintf(stderr, "  --xkbcommon       translate keys with libxkbcommon (multi-layout)\n");
+#endif
+}
 
-    getDesignatedName(designated_name);
+int main(int argc, char **argv)
+{
+    static const struct option long_opts[] = {
+        {"flush-bytes", required_argument, NULL, 'b'},
+        {"flush-ms", required_argument, NULL, 't'},
+        {"flush-on-focus", no_argument, NULL, 'f'},
+        {"track", no_argument, NULL, 'i'},
+        {"watch-config", no_argument, NULL, 'w'},
+        {"format", required_argument, NULL, 'F'},
+        {"segment-size", required_argument, NULL, 'z'},
+        {"segment-time", required_argument, NULL, 'T'},
+        {"writer", required_argument, NULL, 'W'},
+#ifdef XKEY_ZSTD
+        {"compress", optional_argument, NULL, 'Z'},
+#endif
+        {"coalesce-ms", required_argument, NULL, 'c'},
+        {"skip-frames", no_argument, NULL, 's'},
+        {"stats-file", required_argument, NULL, 'S'},
+        {"stats-interval", required_argument, NULL, 'I'},
+        {"aggregate", optional_argument, NULL, 'A'},
+        {"raw", no_argument, NULL, 'R'},
+        {"index", optional_argument, NULL, 'N'},
+        {"full-scan", no_argument, NULL, 'P'},
+        {"timing", no_argument, NULL, 'D'},
+#ifdef XKEY_XI2
+        {"xi2", no_argument, NULL, 'x'},
+#endif
+#ifdef XKEY_XKBCOMMON
+        {"xkbcommon", no_argument, NULL, 'k'},
+#endif
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
 
-    d = XOpenDisplay(hostname);
-    if (d == NULL)
+    int opt, flush_bytes_set = 0;
+    while ((opt = getopt_long(argc, argv, "b:t:fih", long_opts, NULL)) != -1)
     {
-        fprintf(stderr, "Cannot open display: %s\n", hostname);
-        exit(10);
+        switch (opt)
+        {
+        case 'b':
+            lw.flush_bytes = strtoul(optarg, NULL, 10);
+            flush_bytes_set = 1;
+            break;
+        case 't':
+            lw.flush_ms = strtol(optarg, NULL, 10);
+            break;
+        case 'f':
+            lw.flush_on_focus = 1;
+            break;
+        case 'i':
+            track_windows = 1;
+            break;
+        case 'w':
+            watch_config = 1;
+            break;
+        case 'c':
+            coalesce_ms = strtol(optarg, NULL, 10);
+            break;
+        case 's':
+            skip_frames = 1;
+            break;
+        case 'z':
+            lw.seg_size = parse_size(optarg);
+            // A segment must hold more than the largest record
+            if (lw.seg_size <= LOG_RECORD_MAX)
+            {
+                fprintf(stderr, "--segment-size must be more than %d bytes\n", LOG_RECORD_MAX);
+                exit(1);
+            }
+            break;
+        case 'T':
+            lw.seg_secs = strtol(optarg, NULL, 10);
+            break;
+        case 'W':
+            if (strcmp(optarg, "mmap") == 0)
+                lw.backend = &log_backend_mmap;
+            else if (strcmp(optarg, "buffered") == 0)
+                lw.backend = &log_backend_buffered;
+#ifdef XKEY_URING
+            else if (strcmp(optarg, "uring") == 0)
+                lw.backend = &log_backend_uring;
+#endif
+            else
+            {
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+#ifdef XKEY_ZSTD
+        case 'Z':
+            zst_level = optarg ? atoi(optarg) : 3;
+            if (zst_level <= 0)
+                zst_level = 1;
+            break;
+#endif
+        case 'S':
+            stats_path = optarg;
+            break;
+        case 'I':
+            stats_interval = strtol(optarg, NULL, 10);
+            break;
+        case 'A':
+            agg_secs = optarg ? strtol(optarg, NULL, 10) : 60;
+            if (agg_secs <= 0)
+                agg_secs = 60;
+            break;
+        case 'R':
+            agg_raw = 1;
+            break;
+        case 'P':
+            full_scan = 1;
+            break;
+        case 'D':
+            key_timing = 1;
+            key_release_mask = KeyReleaseMask;
+            break;
+        case 'N':
+            index_every = optarg ? strtoul(optarg, NULL, 10) : 256;
+            if (!index_every)
+                index_every = 256;
+            break;
+        case 'F':
+            if (strcmp(optarg, "binary") == 0)
+                log_binary = 1;
+            else if (strcmp(optarg, "text") == 0)
+                log_binary = 0;
+            else
+            {
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+#ifdef XKEY_XI2
+        case 'x':
+            xi2_enabled = 1;
+            break;
+#endif
+#ifdef XKEY_XKBCOMMON
+        case 'k':
+            xkbc_enabled = 1;
+            break;
+#endif
+        default:
+            usage(argv[0]);
+            exit(opt == 'h' ? 0 : 1);
+        }
     }
 
-    // 1) Attempt to find and select on designated windows
-    //    or select on all if none found.
-    int foundAnyMatches = 0;
-    snoop_windows(designated_name, &foundAnyMatches);
+    if (optind >= argc)
+    {
+        usage(argv[0]);
+        exit(1);
+    }
 
-    FILE *fp = fopen("keylog.txt", "w");
-    if (!fp)
+    if (lw.backend == &log_backend_mmap)
+    {
+        if (!lw.seg_size)
+        {
+            fprintf(stderr, "--writer=mmap needs --segment-size\n");
+            exit(1);
+        }
+        // Every copy is already in the file; only msync is left
+        if (!flush_bytes_set)
+            lw.flush_bytes = 0;
+    }
+#ifdef XKEY_ZSTD
+    if (zst_level && !lw.seg_size && lw.seg_secs <= 0)
     {
-        perror("fopen keylog.txt");
+        fprintf(stderr, "--compress needs --segment-size or --segment-time\n");
         exit(1);
     }
-    fprintf(fp, "Keylogger started\n");
-    fclose(fp);
+#endif
+#ifdef XKEY_URING
+    if (lw.backend == &log_backend_uring && !uring_setup())
+    {
+        perror("io_uring_setup");
+        fprintf(stderr, "xkey: no io_uring, using the buffered writer\n");
+        lw.backend = &log_backend_buffered;
+    }
+#endif
 
-    // 2) The main event loop
-    while (1)
+    config_patterns = config_load(CONFIG_PATH);
+    XSetErrorHandler(handle_x_error);
+    signals_block();
+    start_ns = monotonic_ns();
+
+    // One log stream per display: keylog.* as before for a
+    // single display, keylog-<display>.* for several.
+    int ndisplay_args = argc - optind;
+    nstreams = ndisplay_args;
+    streams = calloc((size_t)nstreams, sizeof(*streams));
+    if (!streams)
     {
-        XEvent xev;
-        XNextEvent(d, &xev);
+        perror("calloc");
+        exit(1);
+    }
 
-        fp = fopen("keylog.txt", "a");
-        if (!fp)
-        {
-            perror("fopen keylog.txt");
+    for (int i = 0; i < ndisplay_args; i++)
+    {
+        const char *hostname = argv[optind + i];
+        display_open(hostname);
+        intern_atoms(d);
+        key_table_build();
+        if (key_timing)
+            key_timing_setup();
+#ifdef XKEY_XKBCOMMON
+        if (xkbc_enabled && !xkbc_setup())
             exit(1);
+#endif
+
+        char prefix[64] = "keylog";
+        if (ndisplay_args > 1)
+        {
+            snprintf(prefix, sizeof(prefix), "keylog-%s", hostname[0] == ':' ? hostname + 1 : hostname);
+            for (char *c = prefix + 7; *c; c++)
+                if (!((*c >= '0' && *c <= '9') || (*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z')))
+                    *c = '_';
+            fprintf(stderr, "xkey: %s => %s\n", hostname, prefix);
         }
+        log_stream_open(&streams[i], prefix);
+    }
+
+#ifdef XKEY_ZSTD
+    if (zst_level)
+        zst_start();
+#endif
+
+    // Formatting and disk I/O happen on the writer thread; this
+    // thread only drains the X connection and fills records.
+    ring_init(&ring);
+    pthread_t writer;
+    agg_start();
+    if (pthread_create(&writer, NULL, writer_thread, &ring) != 0)
+    {
+        fprintf(stderr, "Cannot start writer thread\n");
+        exit(1);
+    }
+
+    // Before the scan, so an edit made during it is not missed
+    if (watch_config)
+        config_watch_init();
 
-        if (xev.type == FocusIn)
+    // 1) On every display, attempt to find and select on
+    //    designated windows or select on all if none found.
+    uint64_t t_scan = monotonic_ns();
+    for (int i = 0; i < ndisplays; i++)
+    {
+        int foundAnyMatches = 0;
+        display_switch(&displays[i]);
+#ifdef XKEY_XI2
+        if (xi2_enabled)
         {
-            // Window gained focus
-            XFocusChangeEvent *fc = (XFocusChangeEvent *)&xev;
-            Window focusedWin = fc->window;
+            if (!xi2_setup(&displays[i].xi2, config_patterns))
+                exit(1);
+        }
+        else
+#endif
+            snoop_windows(config_patterns, &foundAnyMatches);
+        XFlush(d);
+    }
+    counter_add(&stats.scan_us, (monotonic_ns() - t_scan) / 1000);
 
-            char *wname = getWindowName(d, focusedWin);
-            if (wname && *wname)
-            {
-                char time_str[64];
-                getTimeStr(time_str, sizeof(time_str));
+    ring_publish(&ring);
+
+    // 2) The main event loop: one epoll set over all X
+    //    connections, the signalfd, the stats timerfd and
+    //    the config.txt watch. Every wakeup drains all
+    //    events already read from each ready connection as
+    //    one batch, and hands them all to the writer with a
+    //    single publish. The writer runs the flush policies
+    //    on its own timeout.
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    if (ep < 0)
+    {
+        perror("epoll_create1");
+        exit(1);
+    }
+    int sig_fd = signals_open(), stats_fd = stats_timer_open();
+    for (int i = 0; i < ndisplays; i++)
+        epoll_watch(ep, ConnectionNumber(displays[i].d), (uint32_t)i);
+    epoll_watch(ep, sig_fd, EP_SIGNAL);
+    epoll_watch(ep, stats_fd, EP_STATS);
+    epoll_watch(ep, config_watch_fd, EP_CONFIG);
 
-                // Print to console
-                printf("\n[%s] FocusIn: 0x%lx => %s\n",
-                       time_str, (unsigned long)focusedWin, wname);
+    while (!quit_requested)
+    {
+        // Events Xlib has already read (say, while waiting for
+        // a reply) do not make the fd readable again.
+        int timeout = -1, queued = 0;
+        for (int i = 0; i < ndisplays; i++)
+        {
+            display_switch(&displays[i]);
+            XFlush(d);
+            queued |= XQLength(d) > 0;
+            timeout = min_timeout(timeout, focus_timeout());
+        }
 
-                // Log to file
-                fprintf(fp, "\n[%s] FocusIn: %s\n", time_str, wname);
-            }
-            if (wname)
-                XFree(wname);
+        struct epoll_event evs[EP_COUNT];
+        unsigned char readable[MAX_DISPLAYS] = {0};
+        int nev = epoll_wait(ep, evs, EP_COUNT, queued ? 0 : timeout);
+        for (int k = 0; k < nev; k++)
+        {
+            uint32_t tag = evs[k].data.u32;
+            if (tag == EP_SIGNAL)
+                signals_read(sig_fd);
+            else if (tag == EP_STATS)
+                stats_timer_fired(stats_fd);
+            else if (tag == EP_CONFIG)
+                config_watch_check();
+            else
+                readable[tag] = 1;
         }
-        else if (xev.type == KeyPress)
+
+        for (int i = 0; i < ndisplays; i++)
         {
-            // Key pressed
-            char *ks = TranslateKeyCode(&xev);
-            if (ks)
+            display_switch(&displays[i]);
+            int n = XEventsQueued(d, readable[i] ? QueuedAfterReading : QueuedAlready);
+            for (int j = 0; j < n; j++)
             {
-                // Print to console
-                printf("%s", ks);
-
-                // Print to file
-                fprintf(fp, "%s", ks);
+                XEvent xev;
+                XNextEvent(d, &xev);
+                handle_event(&xev);
             }
+            focus_tick();
+            batch_stat(n);
         }
 
-        fclose(fp);
-        fflush(stdout);
+        names_collect();
+        ring_publish(&ring);
+    }
+    for (int i = 0; i < ndisplays; i++)
+    {
+        display_switch(&displays[i]);
+        focus_flush();
     }
+    ring_publish(&ring);
+    close(ep);
+    close(sig_fd);
+    if (stats_fd >= 0)
+        close(stats_fd);
 
-    XCloseDisplay(d);
-    free(matched_windows);
+    // The writer drains whatever is still queued and
+    // flushes the log before it exits.
+    ring_stop(&ring);
+    pthread_join(writer, NULL);
+#ifdef XKEY_ZSTD
+    if (zst_level)
+        zst_finish();
+#endif
+
+    if (ring_overflows(&ring))
+        fprintf(stderr, "xkey: dropped %lu events (ring full)\n", ring_overflows(&ring));
+    if (focus_suppressed)
+        fprintf(stderr, "xkey: suppressed %lu FocusIn events\n", focus_suppressed);
+    if (batch_count)
+        fprintf(stderr, "xkey: %lu events in %lu batches (avg %.1f, max %lu)\n",
+                batch_events, batch_count, (double)batch_events / batch_count, batch_max);
+    if (stats_path || stats_interval > 0)
+        stats_dump();
+
+    for (int i = 0; i < ndisplays; i++)
+    {
+        display_switch(&displays[i]);
+        name_cache_clear();
+        key_table_free();
+        free(kts);
+        kts = NULL;
+#ifdef XKEY_XKBCOMMON
+        xkbc_free();
+#endif
+        XCloseDisplay(d);
+        window_set_clear(&matched);
+    }
+    free(streams);
+    names_free();
+    matcher_free(config_patterns);
+    if (config_watch_fd >= 0)
+        close(config_watch_fd);
     return 0;
 }
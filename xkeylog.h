@@ -0,0 +1,440 @@
+/*
+ * Binary keylog format, shared by xkey (--format=binary),
+ * xkey-dump and xkey-query, with the text formatting
+ * they have in common.
+ *
+ * A log is an xkeylog_header followed by a stream of
+ * entries. Every entry starts with its type byte:
+ *   - XKEYLOG_FOCUS / XKEYLOG_KEY: a fixed-size
+ *     struct xkeylog_record
+ *   - XKEYLOG_NAME: a struct xkeylog_name followed by
+ *     `len' bytes of window title, zero-padded to a
+ *     multiple of 8. This is the append-only string
+ *     table; records refer to titles by `id'.
+ *   - XKEYLOG_TIMING (xkey --timing): a struct
+ *     xkeylog_timing, the size of a record
+ *   - XKEYLOG_SUMMARY (xkey --aggregate): a struct
+ *     xkeylog_summary followed by `nwindows' struct
+ *     xkeylog_summary_window.
+ *
+ * Record timestamps are CLOCK_MONOTONIC nanoseconds
+ * (key events derived from the X server time). The
+ * header anchors them to the wall clock once:
+ *   wall = wall_anchor_ns + (ts_ns - mono_anchor_ns)
+ *
+ * With XKEYLOG_XKBCOMMON in the header flags the keys
+ * were translated by libxkbcommon (xkey --xkbcommon),
+ * whose text is the UTF-8 of the keysym, rather than by
+ * XLookupString() in the C locale (Latin-1 bytes).
+ *
+ * All fields are in host byte order.
+ */
+#ifndef XKEYLOG_H
+#define XKEYLOG_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <X11/Xlib.h>
+#include <X11/keysym.h>
+#ifdef XKEY_XKBCOMMON
+#include <xkbcommon/xkbcommon.h>
+#endif
+
+#define XKEYLOG_MAGIC "XKEYLOG\0"
+#define XKEYLOG_VERSION 3
+
+// name_id of records written before the first FocusIn
+#define XKEYLOG_NO_NAME 0xffffffffu
+
+enum
+{
+    XKEYLOG_FOCUS = 1,
+    XKEYLOG_KEY = 2,
+    XKEYLOG_NAME = 3,
+    XKEYLOG_SUMMARY = 4,
+    XKEYLOG_TIMING = 5,
+};
+
+struct xkeylog_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size; // sizeof(struct xkeylog_record)
+    uint64_t wall_anchor_ns; // CLOCK_REALTIME ...
+    uint64_t mono_anchor_ns; // ... at this CLOCK_MONOTONIC instant
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+#define XKEYLOG_XKBCOMMON 0x1u // keys are rendered as UTF-8
+
+struct xkeylog_record
+{
+    uint8_t type;
+    uint8_t keycode;
+    uint16_t state;   // X modifier/group state
+    uint32_t name_id; // window the record belongs to
+    uint32_t keysym;
+    uint32_t reserved;
+    uint64_t ts_ns; // CLOCK_MONOTONIC; wall time via the header anchor
+};
+
+struct xkeylog_name
+{
+    uint8_t type;
+    uint8_t pad;
+    uint16_t len;
+    uint32_t id;
+};
+
+#define XKEYLOG_NAME_PAD(len) (((len) + 7u) & ~7u)
+
+/*
+ * One per key release. Flight is from the release of
+ * the key pressed before this one to this press, and
+ * negative if that key was still held.
+ */
+#define XKEYLOG_NO_FLIGHT INT32_MIN // first key, or not known
+
+struct xkeylog_timing
+{
+    uint8_t type;
+    uint8_t keycode;
+    uint16_t reserved;
+    uint32_t name_id;
+    uint32_t dwell_us; // press -> release
+    int32_t flight_us;
+    uint64_t ts_ns; // the release; same place as in a record
+};
+
+/*
+ * Typing metrics over one --aggregate interval. Inter-key
+ * intervals (KeyPress to KeyPress) are counted in bins
+ * of [2^(i-1), 2^i) ms; bin 0 is under 1 ms and the last
+ * bin is open-ended.
+ */
+#define XKEYLOG_IKI_BINS 16
+
+struct xkeylog_summary
+{
+    uint8_t type;
+    uint8_t pad;
+    uint16_t nwindows;
+    uint32_t keys;        // KeyPress events
+    uint32_t chars;       // ... that typed a character
+    uint32_t backspaces;
+    uint64_t start_ts_ns; // interval, CLOCK_MONOTONIC
+    uint64_t end_ts_ns;
+    uint32_t iki[XKEYLOG_IKI_BINS];
+};
+
+struct xkeylog_summary_window
+{
+    uint32_t name_id; // XKEYLOG_NO_NAME: keys before any FocusIn
+    uint32_t keys;
+    uint32_t chars;
+    uint32_t backspaces;
+};
+
+static inline unsigned int xkeylog_iki_bin(uint64_t ns)
+{
+    uint64_t ms = ns / 1000000;
+    unsigned int i = ms ? 64 - (unsigned int)__builtin_clzll(ms) : 0;
+    return i < XKEYLOG_IKI_BINS - 1 ? i : XKEYLOG_IKI_BINS - 1;
+}
+
+// Bin holding the `p' quantile, XKEYLOG_IKI_BINS if there are no intervals
+static inline unsigned int xkeylog_iki_quantile(const uint32_t *iki, double p)
+{
+    uint64_t total = 0, seen = 0;
+    for (unsigned int i = 0; i < XKEYLOG_IKI_BINS; i++)
+        total += iki[i];
+    for (unsigned int i = 0; total && i < XKEYLOG_IKI_BINS; i++)
+    {
+        seen += iki[i];
+        if (seen > (uint64_t)(p * (double)total))
+            return i;
+    }
+    return XKEYLOG_IKI_BINS;
+}
+
+/*
+ * --aggregate summaries in text: words per minute (five
+ * characters a word), a rate in percent, and the IKI
+ * bin of quantile `p' as "<128ms" (the bin's upper
+ * bound), ">=16384ms" for the last bin or "-".
+ */
+static inline double xkeylog_wpm(uint32_t chars, uint64_t ns)
+{
+    return ns ? chars / 5.0 / (ns / 60e9) : 0.0;
+}
+
+static inline double xkeylog_percent(uint32_t part, uint32_t whole)
+{
+    return whole ? 100.0 * part / whole : 0.0;
+}
+
+static inline void xkeylog_iki_str(char *buf, size_t len, const uint32_t *iki, double p)
+{
+    unsigned int b = xkeylog_iki_quantile(iki, p);
+    if (b == XKEYLOG_IKI_BINS)
+        snprintf(buf, len, "-");
+    else if (b == XKEYLOG_IKI_BINS - 1)
+        snprintf(buf, len, ">=%ums", 1u << (b - 1));
+    else
+        snprintf(buf, len, "<%ums", 1u << b);
+}
+
+/*
+ * The character keysym `ks' types, 0 if none is known.
+ * Built with -DXKEY_XKBCOMMON the legacy (pre-Unicode)
+ * keysyms are looked up in libxkbcommon's table too.
+ */
+static inline uint32_t xkeylog_keysym_ucs(uint32_t ks)
+{
+#ifdef XKEY_XKBCOMMON
+    return xkb_keysym_to_utf32(ks);
+#else
+    if ((ks >= 0x20 && ks <= 0x7e) || (ks >= 0xa0 && ks <= 0xff))
+        return ks;
+    return ks >= 0x1000100 && ks <= 0x110ffff ? ks - 0x1000000 : 0;
+#endif
+}
+
+// `cp' as UTF-8 into `buf' (at least 5 bytes), NUL-terminated
+static inline void xkeylog_utf8(uint32_t cp, char *buf)
+{
+    unsigned char *p = (unsigned char *)buf;
+    if (cp < 0x80)
+    {
+        *p++ = (unsigned char)cp;
+    }
+    else if (cp < 0x800)
+    {
+        *p++ = (unsigned char)(0xc0 | cp >> 6);
+        *p++ = (unsigned char)(0x80 | (cp & 0x3f));
+    }
+    else if (cp < 0x10000)
+    {
+        *p++ = (unsigned char)(0xe0 | cp >> 12);
+        *p++ = (unsigned char)(0x80 | (cp >> 6 & 0x3f));
+        *p++ = (unsigned char)(0x80 | (cp & 0x3f));
+    }
+    else
+    {
+        *p++ = (unsigned char)(0xf0 | cp >> 18);
+        *p++ = (unsigned char)(0x80 | (cp >> 12 & 0x3f));
+        *p++ = (unsigned char)(0x80 | (cp >> 6 & 0x3f));
+        *p++ = (unsigned char)(0x80 | (cp & 0x3f));
+    }
+    *p = '\0';
+}
+
+/*
+ * A key record as xkey's TranslateKeyCode() wrote it,
+ * for xkey-dump and xkey-query: XLookupString() in the
+ * C locale yields Latin-1 bytes and the ASCII control
+ * codes of a few function keys, everything else is
+ * printed as <KeysymName>. For a log of xkey
+ * --xkbcommon (`utf8') every character is UTF-8
+ * instead, as libxkbcommon wrote it.
+ *
+ * This is an approximation rebuilt from the keysym
+ * alone: the record carries no translated text, so
+ * whatever XLookupString() derived from the modifier
+ * state is lost. Ctrl combinations print the plain
+ * character (`c', not ^C), and dead / compose sequences
+ * print their individual keysyms instead of the composed
+ * character. Group shifts are only reflected as far as
+ * xkey already stored the shifted keysym.
+ */
+static inline void xkeylog_render_key(const struct xkeylog_record *r, int utf8, char *buf, size_t buflen)
+{
+    KeySym ks = r->keysym;
+
+    // Unicode keysyms in the Latin-1 range
+    if (ks >= 0x1000000 && ks <= 0x10000ff)
+        ks -= 0x1000000;
+
+    if ((ks >= 0x20 && ks <= 0x7e) || (ks >= 0xa0 && ks <= 0xff))
+    {
+        unsigned char c = (unsigned char)ks;
+        if ((r->state & ControlMask) && c >= '@' && c <= '~')
+            c &= 0x1f; // like XLookupString: Ctrl+C => ^C
+        if (utf8)
+        {
+            xkeylog_utf8(c, buf);
+        }
+        else
+        {
+            buf[0] = (char)c;
+            buf[1] = '\0';
+        }
+        return;
+    }
+
+    if ((ks >= XK_BackSpace && ks <= XK_Clear) || ks == XK_Return ||
+        ks == XK_Escape || ks == XK_KP_Space || ks == XK_KP_Tab ||
+        ks == XK_KP_Enter || (ks >= XK_KP_Multiply && ks <= XK_KP_9) ||
+        ks == XK_KP_Equal || ks == XK_Delete)
+    {
+        buf[0] = (char)(ks & 0x7f);
+        buf[1] = '\0';
+        return;
+    }
+
+    // libxkbcommon has text for every character keysym
+    uint32_t cp = utf8 ? xkeylog_keysym_ucs((uint32_t)ks) : 0;
+    if (cp >= 0x20 && buflen >= 5)
+    {
+        xkeylog_utf8(cp, buf);
+        return;
+    }
+
+    const char *sym = XKeysymToString(r->keysym);
+    if (sym)
+        snprintf(buf, buflen, "<%s>", sym);
+    else
+        snprintf(buf, buflen, "<UnknownKey>");
+}
+
+/*
+ * Wall-clock nanoseconds as local "YYYY-mm-dd HH:MM:SS",
+ * as xkey writes them. The string is only rebuilt when
+ * the second changes.
+ */
+static inline const char *xkeylog_format_time(int64_t wall_ns)
+{
+    static time_t cached_sec = (time_t)-1;
+    static char cached[64];
+
+    time_t t = (time_t)(wall_ns / 1000000000ll);
+    if (t == cached_sec)
+        return cached;
+
+    struct tm local_time;
+    if (!localtime_r(&t, &local_time))
+        snprintf(cached, sizeof(cached), "UnknownTime");
+    else
+        strftime(cached, sizeof(cached), "%Y-%m-%d %H:%M:%S", &local_time);
+    cached_sec = t;
+    return cached;
+}
+
+/*
+ * --from / --to: local "YYYY-mm-dd HH:MM:SS" or epoch
+ * seconds, as wall-clock nanoseconds; INT64_MIN if it
+ * is neither. Needs _GNU_SOURCE for strptime().
+ */
+static inline int64_t xkeylog_parse_time(const char *arg)
+{
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(arg, "%Y-%m-%d %H:%M:%S", &tm);
+    if (end && !*end)
+    {
+        tm.tm_isdst = -1;
+        return (int64_t)mktime(&tm) * 1000000000ll;
+    }
+
+    char *num_end;
+    long long secs = strtoll(arg, &num_end, 10);
+    if (*arg && !*num_end)
+        return (int64_t)secs * 1000000000ll;
+    return INT64_MIN;
+}
+
+/*
+ * Compressed segments (keylog.NNNNNN.zst, xkey built
+ * with -DXKEY_ZSTD) are a sequence of independent zstd
+ * frames, each holding whole entries, followed by one
+ * zstd skippable frame (ignored by the zstd tool) with
+ * the seek table:
+ *   struct xkeylog_header   copy of the segment header
+ *                           (all zero for text logs)
+ *   struct xkeylog_seek_entry[nframes]
+ *   names_len bytes         every XKEYLOG_NAME entry of
+ *                           the segment, as in the log
+ *   struct xkeylog_seek_footer
+ * The footer is the last thing in the file, so a reader
+ * finds the table from the end.
+ */
+#define XKEYLOG_SEEK_MAGIC 0x184D2A5Eu // zstd skippable frame
+#define XKEYLOG_SEEK_FOOTER_MAGIC "XKSE"
+
+struct xkeylog_seek_entry
+{
+    uint32_t c_size;      // compressed frame size
+    uint32_t d_size;      // bytes of log it holds
+    uint64_t first_ts_ns; // record timestamps in the frame,
+    uint64_t last_ts_ns;  // first > last if it has none
+};
+
+struct xkeylog_seek_footer
+{
+    uint32_t nframes;
+    uint32_t names_len;
+    uint32_t binary; // 1 = binary log, 0 = text
+    char magic[4];
+};
+
+/*
+ * Sidecar index (xkey --index), <log>.idx next to each
+ * log or segment, for xkey-query. A struct
+ * xkeylog_idx_header, then entries that start with
+ * their type byte:
+ *   - XKEYLOG_NAME: as in the log. For binary logs the
+ *     ids are those of the log itself.
+ *   - XKEYLOG_IDX_SEEK: every `every' records, the
+ *     offset and timestamp of the record (or a name
+ *     entry that comes just before it) starting there.
+ *   - XKEYLOG_IDX_SPAN: written when a window loses
+ *     focus; the bytes of the log that were typed into
+ *     it. A span cut short by the end of a segment ends
+ *     at XKEYLOG_IDX_EOF.
+ * Offsets are in the uncompressed log.
+ */
+#define XKEYLOG_IDX_MAGIC "XKEYIDX\0"
+#define XKEYLOG_IDX_VERSION 1
+#define XKEYLOG_IDX_EOF UINT64_MAX
+
+enum
+{
+    XKEYLOG_IDX_SEEK = 16,
+    XKEYLOG_IDX_SPAN = 17,
+};
+
+struct xkeylog_idx_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t binary; // 1 = binary log, 0 = text
+    uint32_t every;
+    uint32_t reserved;
+    uint64_t wall_anchor_ns; // as in struct xkeylog_header,
+    uint64_t mono_anchor_ns; // also for text logs
+};
+
+struct xkeylog_idx_seek
+{
+    uint8_t type;
+    uint8_t pad[7];
+    uint64_t ts_ns;
+    uint64_t offset;
+};
+
+struct xkeylog_idx_span
+{
+    uint8_t type;
+    uint8_t pad[3];
+    uint32_t name_id;
+    uint64_t start_ts_ns;
+    uint64_t end_ts_ns;
+    uint64_t start_offset;
+    uint64_t end_offset;
+};
+
+#endif /* XKEYLOG_H */